@@ -2,24 +2,20 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
-#include <openssl/evp.h>
-#include <openssl/bio.h>
-#include <openssl/ssl.h>
-
-/*-------------------------
-| CONSTS
-|-------------------------*/
-#define MAX_BUFFER 256
+#include "client_lib.h"
 
 /*-------------------------
 | PRE-DECLARATIONS
 | - main() dependencies
 |-------------------------*/
-void error(char *msg);
+int read_line(char *buffer);
 int ascii_buffer(char *buffer);
+void print_notification(char *notification, void *arg);
 
 /*-------------------------
 | MAIN()
+| - interactive wrapper
+|   around client_lib
 |-------------------------*/
 int main(int argc, char *argv[])
 {
@@ -30,179 +26,75 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    // Generate EC keys
-    EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
-    if (key_ctx == NULL)
-    {
-        fprintf(stderr, "Error generating key context\n");
-        exit(1);
-    }
-
-    if (EVP_PKEY_keygen_init(key_ctx) <= 0)
-    {
-        fprintf(stderr, "Error generating keygen\n");
-        exit(1);
-    }
-
-    if (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx, NID_X9_62_prime256v1) <= 0)
-    {
-        fprintf(stderr, "Error generating elliptic curve\n");
-        exit(1);
-    }
+    // Initalise variables
+    char buffer[MAX_BUFFER], value[MAX_BUFFER], reply[MAX_BUFFER], target[MAX_BUFFER];
 
-    EVP_PKEY *keys;
-    if (EVP_PKEY_keygen(key_ctx, &keys) <= 0)
+    // unix socket with -u 'path', otherwise TLS to 'address' 'port'
+    if (strcmp(argv[1], "-u") == 0)
     {
-        fprintf(stderr, "Error generating keys\n");
-        exit(1);
+        snprintf(target, MAX_BUFFER, "unix:%s", argv[2]);
     }
-
-    EVP_PKEY_CTX_free(key_ctx);
-
-    // Initialise OpenSSL SSL context object
-    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
-    if (ctx == NULL)
+    else
     {
-        fprintf(stderr, "Error generating SSL context\n");
-        exit(1);
+        snprintf(target, MAX_BUFFER, "%s:%s", argv[1], argv[2]);
     }
 
-    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
-
-    // Initalise variables
-    int action;
-    char buffer[MAX_BUFFER], host_port[100];
+    // notifications are printed from the pool's thread
+    setvbuf(stdout, NULL, _IOLBF, 0);
 
-    strcpy(host_port, argv[1]);
-    strcat(host_port, ":");
-    strcat(host_port, argv[2]);
-
-    // Initialise OpenSSL socket
-    BIO *bio = BIO_new_ssl_connect(ctx);
-    if (bio == NULL)
+    // first message must be CONNECT
+    if (read_line(buffer) < 0 || strncmp(buffer, "CONNECT ", 8) != 0)
     {
-        fprintf(stderr, "Error initalising BIO socket\n");
+        fprintf(stderr, "Error first message must be CONNECT 'client_id'\n");
         exit(1);
     }
 
-    // Initialise SSL
-    SSL *ssl;
-    if (BIO_get_ssl(bio, &ssl) <= 0)
-    {
-        fprintf(stderr, "Error initialising ssl\n");
-        exit(1);
-    }
-
-    SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
-    if(BIO_set_conn_hostname(bio, host_port) <= 0)
-    {
-        fprintf(stderr, "Error adding hostname\n");
-        exit(1);
-    }
-    
     // Connect to server
-    if (BIO_do_connect(bio) <= 0)
+    client_pool *pool = client_pool_new(target, &buffer[strlen("CONNECT ")], 1);
+    if (pool == NULL)
     {
-        fprintf(stderr, "Error connecting to server\n");
-        BIO_free(bio);
-        exit(1);
-    }
-
-    // Perform TLS handshake
-    if (BIO_do_handshake(bio) <= 0)
-    {
-        fprintf(stderr, "Error on TLS handshake\n");
-        BIO_free(bio);
+        printf("CONNECT: ERROR\n");
         exit(1);
     }
+    printf("CONNECT: OK\n");
+    client_pool_on_notify(pool, print_notification, NULL);
 
     while (1)
     {
-        // Client input
-        memset(buffer, 0, MAX_BUFFER);
-        fgets(buffer, MAX_BUFFER, stdin);
-        if (ascii_buffer(buffer) < 0)
-        {
-            fprintf(stderr, "Error input contains non-ASCII characters\n");
-            BIO_free(bio);
-            exit(1);
-        }
-        
-        // check ascii chars
-        if (BIO_write(bio, buffer, strlen(buffer)) <= 0)
+        // Client input, stop at end of input
+        if (read_line(buffer) < 0)
         {
-            fprintf(stderr, "Error writing to server\n");
-            BIO_free(bio);
-            exit(1);
+            break;
         }
 
-        // receive a message
-        memset(buffer, 0, MAX_BUFFER);
-        if ((action = BIO_read(bio, buffer, MAX_BUFFER)) <= 0)
+        // PUT & SPUT take the value on the next line
+        char *put_value = NULL;
+        if (strncmp(buffer, "PUT ", 4) == 0 || strncmp(buffer, "SPUT ", 5) == 0)
         {
-            fprintf(stderr, "Error reading from server\n");
-            BIO_free(bio);
-            exit(1);
+            if (read_line(value) < 0)
+            {
+                break;
+            }
+            put_value = value;
         }
 
-        // check ascii chars
-        if (ascii_buffer(buffer) < 0)
+        if (client_call(pool, buffer, put_value, reply) < 0)
         {
-            fprintf(stderr, "Error input contains non-ASCII characters\n");
-            BIO_free(bio);
+            fprintf(stderr, "Error communicating with server\n");
+            client_pool_free(pool);
             exit(1);
         }
-
-        else if (strcmp(buffer, "ACK") == 0)
-        {
-            // send the value
-            memset(buffer, 0, MAX_BUFFER);
-            fgets(buffer, MAX_BUFFER, stdin);
-
-            // check ascii chars
-            if (ascii_buffer(buffer) < 0)
-            {
-                fprintf(stderr, "Error input contains non-ASCII characters\n");
-                BIO_free(bio);
-                exit(1);
-            }
-
-            if (BIO_write(bio, buffer, strlen(buffer)) <= 0)
-            {
-                fprintf(stderr, "Error writing to server\n");
-                BIO_free(bio);
-                exit(1);
-            }
-
-            // receive a message
-            memset(buffer, 0, MAX_BUFFER - 1);
-            if ((action = BIO_read(bio, buffer, MAX_BUFFER)) < 0)
-            {
-                fprintf(stderr, "Error reading from server\n");
-                BIO_free(bio);
-                exit(1);
-            }
-
-            // check ascii chars
-            if (ascii_buffer(buffer) < 0)
-            {
-                fprintf(stderr, "Error input contains non-ASCII characters\n");
-                BIO_free(bio);
-                exit(1);
-            }
-        }
-
-        printf("%s\n", buffer);
+        printf("%s\n", reply);
 
         // disconnect gracefully
-        if (strstr(buffer, "DISCONNECT: OK") || strstr(buffer, "CONNECT: ERROR"))
+        if (strcmp(reply, "DISCONNECT: OK") == 0)
         {
             break;
         }
     }
 
     // close socket
-    BIO_free(bio);
+    client_pool_free(pool);
 
     return 0;
 }
@@ -211,6 +103,26 @@ int main(int argc, char *argv[])
 | FUNCTIONS
 |-------------------------*/
 
+// reads a line of input without the newline, -1 at end of input
+int read_line(char *buffer)
+{
+    memset(buffer, 0, MAX_BUFFER);
+    if (fgets(buffer, MAX_BUFFER, stdin) == NULL)
+    {
+        return -1;
+    }
+
+    // check ascii chars
+    if (ascii_buffer(buffer) < 0)
+    {
+        fprintf(stderr, "Error input contains non-ASCII characters\n");
+        exit(1);
+    }
+
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+    return 0;
+}
+
 // checks buffer contains only ASCII characters
 int ascii_buffer(char *buffer)
 {
@@ -222,4 +134,10 @@ int ascii_buffer(char *buffer)
         }
     }
     return 0;
-}
\ No newline at end of file
+}
+
+// prints notifications pushed by the server
+void print_notification(char *notification, void *arg)
+{
+    printf("%s\n", notification);
+}
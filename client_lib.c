@@ -0,0 +1,878 @@
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/bio.h>
+#include <openssl/ssl.h>
+#include "client_lib.h"
+
+/*-------------------------
+| STRUCTS
+| - requests are queued on
+|   the pool and run by a
+|   thread per connection
+|-------------------------*/
+struct client_future {
+    char command[MAX_BUFFER];
+    char value[MAX_BUFFER];
+    int has_value;
+    char reply[MAX_BUFFER];
+    int status; // 0 while pending, 1 when done, -1 when failed
+    client_callback callback;
+    void *arg;
+    int refs; // the caller & the pool each hold one
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct client_future *next;
+};
+
+// one persistent connection & the thread that runs requests on it
+typedef struct {
+    client_pool *pool;
+    int id;
+    BIO *bio; // NULL while disconnected
+    SSL *ssl; // NULL for unix socket connections
+    SSL_SESSION *session; // kept to resume TLS on reconnect
+    int wire_compress; // OPTION COMPRESS was accepted, replayed on reconnect
+    char *watches[MAX_BUFFER]; // WATCH & SWATCH commands, replayed on reconnect
+    int n_watches;
+    client_future *head, *tail; // requests only this slot may run
+    int wake[2]; // one byte per request queued on the slot
+    pthread_t thread;
+} client_slot;
+
+struct client_pool {
+    char target[MAX_BUFFER];
+    char client_id[MAX_BUFFER];
+    SSL_CTX *ctx;
+    int size;
+    client_slot *slots;
+    client_future *head, *tail; // queued requests any slot may run
+    int wake[2]; // one byte per request queued on the pool, or per slot when closing
+    int closing;
+    client_notify_callback on_notify;
+    void *notify_arg;
+    pthread_mutex_t lock; // guards the queue & notify callback
+};
+
+/*-------------------------
+| PRE-DECLARATIONS
+|-------------------------*/
+static void *slot_worker(void *arg);
+static int slot_connect(client_slot *slot);
+static void slot_reconnect(client_slot *slot);
+static void slot_close(client_slot *slot);
+static int slot_exchange(client_slot *slot, client_future *future);
+static int slot_read(client_slot *slot, char *buffer, int idle);
+static void run(client_slot *slot, client_future *future);
+static void complete(client_future *future, int status);
+static void enqueue(client_future **head, client_future **tail, client_future *future);
+static client_future *dequeue(client_future **head, client_future **tail);
+static int session_command(char *command);
+static int idempotent(char *command);
+static BIO *tls_connect(SSL_CTX *ctx, char *host_port, SSL **ssl, SSL_SESSION *session);
+static BIO *unix_connect(char *path);
+static int decode_value(char *buffer);
+static int ascii_buffer(char *buffer);
+static void clear_sigpipe(void);
+
+/*-------------------------
+| POOL
+|-------------------------*/
+
+// connects 'size' connections to target
+client_pool *client_pool_new(char *target, char *client_id, int size)
+{
+    if (size < 1 || strlen(target) >= MAX_BUFFER || strlen(client_id) >= MAX_BUFFER - 16)
+    {
+        return NULL;
+    }
+
+    client_pool *pool = calloc(1, sizeof(client_pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    strcpy(pool->target, target);
+    strcpy(pool->client_id, client_id);
+    pool->size = size;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    // Initialise OpenSSL SSL context object
+    pool->ctx = SSL_CTX_new(TLS_client_method());
+    pool->slots = calloc(size, sizeof(client_slot));
+    if (pool->ctx == NULL || pool->slots == NULL || pipe(pool->wake) < 0)
+    {
+        fprintf(stderr, "Error initialising client pool\n");
+        SSL_CTX_free(pool->ctx);
+        free(pool->slots);
+        free(pool);
+        return NULL;
+    }
+    SSL_CTX_set_verify(pool->ctx, SSL_VERIFY_NONE, NULL);
+    fcntl(pool->wake[0], F_SETFL, O_NONBLOCK);
+
+    // writing to a connection the server closed raises SIGPIPE, which would kill the host application
+    // it stays blocked while connecting, & the workers inherit the mask so it is blocked for good there
+    sigset_t sigpipe, old_mask;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+
+    // connect every slot up front so a bad target or client_id fails here
+    int started = 0;
+    for (int i = 0; i < size; i++)
+    {
+        pool->slots[i].pool = pool;
+        pool->slots[i].id = i;
+        if (pipe(pool->slots[i].wake) < 0)
+        {
+            break;
+        }
+        fcntl(pool->slots[i].wake[0], F_SETFL, O_NONBLOCK);
+        if (slot_connect(&pool->slots[i]) < 0 || pthread_create(&pool->slots[i].thread, NULL, slot_worker, &pool->slots[i]) != 0)
+        {
+            slot_close(&pool->slots[i]);
+            close(pool->slots[i].wake[0]);
+            close(pool->slots[i].wake[1]);
+            break;
+        }
+        started++;
+    }
+    clear_sigpipe();
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (started < size)
+    {
+        pool->size = started;
+        client_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// finishes queued requests, disconnects & frees the pool
+void client_pool_free(client_pool *pool)
+{
+    // each worker exits when it reads a wake byte with nothing queued
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->size; i++)
+    {
+        if (write(pool->wake[1], "!", 1) < 0)
+        {
+            fprintf(stderr, "Error waking client pool\n");
+        }
+    }
+
+    for (int i = 0; i < pool->size; i++)
+    {
+        pthread_join(pool->slots[i].thread, NULL);
+        SSL_SESSION_free(pool->slots[i].session);
+        for (int j = 0; j < pool->slots[i].n_watches; j++)
+        {
+            free(pool->slots[i].watches[j]);
+        }
+        close(pool->slots[i].wake[0]);
+        close(pool->slots[i].wake[1]);
+    }
+
+    close(pool->wake[0]);
+    close(pool->wake[1]);
+    SSL_CTX_free(pool->ctx);
+    free(pool->slots);
+    free(pool);
+}
+
+// sets the callback for notifications from WATCH & SWATCH
+void client_pool_on_notify(client_pool *pool, client_notify_callback callback, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->on_notify = callback;
+    pool->notify_arg = arg;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*-------------------------
+| REQUESTS
+|-------------------------*/
+
+// queues a command, session commands for the first connection & the rest for the next free one
+client_future *client_send(client_pool *pool, char *command, char *value, client_callback callback, void *arg)
+{
+    if (strlen(command) >= MAX_BUFFER || (value != NULL && strlen(value) >= MAX_BUFFER))
+    {
+        return NULL;
+    }
+
+    client_future *future = calloc(1, sizeof(client_future));
+    if (future == NULL)
+    {
+        return NULL;
+    }
+    strcpy(future->command, command);
+    if (value != NULL)
+    {
+        strcpy(future->value, value);
+        future->has_value = 1;
+    }
+    future->callback = callback;
+    future->arg = arg;
+    future->refs = 2;
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->done, NULL);
+
+    // the private session belongs to the first connection, so its commands stay there in order
+    int wake = pool->wake[1];
+    pthread_mutex_lock(&pool->lock);
+    if (session_command(command))
+    {
+        enqueue(&pool->slots[0].head, &pool->slots[0].tail, future);
+        wake = pool->slots[0].wake[1];
+    }
+    else
+    {
+        enqueue(&pool->head, &pool->tail, future);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // wake one worker, blocks only if the pipe is full of queued requests
+    if (write(wake, "!", 1) < 0)
+    {
+        fprintf(stderr, "Error waking client pool\n");
+    }
+    return future;
+}
+
+// waits for a request to complete
+int client_wait(client_future *future, char *reply)
+{
+    pthread_mutex_lock(&future->lock);
+    while (future->status == 0)
+    {
+        pthread_cond_wait(&future->done, &future->lock);
+    }
+    int status = future->status;
+    if (reply != NULL)
+    {
+        strcpy(reply, status > 0 ? future->reply : "");
+    }
+    pthread_mutex_unlock(&future->lock);
+    return status > 0 ? 0 : -1;
+}
+
+// releases the caller's reference to a future
+void client_future_free(client_future *future)
+{
+    if (future == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&future->lock);
+    int refs = --future->refs;
+    pthread_mutex_unlock(&future->lock);
+
+    if (refs == 0)
+    {
+        pthread_mutex_destroy(&future->lock);
+        pthread_cond_destroy(&future->done);
+        free(future);
+    }
+}
+
+// sends a command & waits for the reply
+int client_call(client_pool *pool, char *command, char *value, char *reply)
+{
+    client_future *future = client_send(pool, command, value, NULL, NULL);
+    if (future == NULL)
+    {
+        return -1;
+    }
+    int status = client_wait(future, reply);
+    client_future_free(future);
+    return status;
+}
+
+/*-------------------------
+| FUNCTIONS
+|-------------------------*/
+
+// runs queued requests on one connection, reading notifications while idle
+static void *slot_worker(void *arg)
+{
+    client_slot *slot = (client_slot *) arg;
+    client_pool *pool = slot->pool;
+    char buffer[MAX_BUFFER], wake;
+    struct pollfd fds[3];
+    int n_fds, fd;
+
+    while (1)
+    {
+        // wait for a request, or a notification on a live connection
+        fds[0].fd = pool->wake[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = slot->wake[0];
+        fds[1].events = POLLIN;
+        n_fds = 2;
+        if (slot->bio != NULL && BIO_get_fd(slot->bio, &fd) >= 0)
+        {
+            fds[2].fd = fd;
+            fds[2].events = POLLIN;
+            n_fds = 3;
+        }
+        if ((slot->ssl == NULL || SSL_pending(slot->ssl) == 0) && poll(fds, n_fds, -1) < 0)
+        {
+            continue;
+        }
+
+        // a notification, or the server closing the connection
+        if (slot->bio != NULL && ((slot->ssl != NULL && SSL_pending(slot->ssl) > 0) || (n_fds == 3 && fds[2].revents != 0)))
+        {
+            if (slot_read(slot, buffer, 1) < 0)
+            {
+                slot_close(slot);
+                slot_reconnect(slot);
+            }
+        }
+
+        // requests for this slot alone
+        if ((fds[1].revents & POLLIN) && read(slot->wake[0], &wake, 1) == 1)
+        {
+            pthread_mutex_lock(&pool->lock);
+            client_future *future = dequeue(&slot->head, &slot->tail);
+            pthread_mutex_unlock(&pool->lock);
+            if (future != NULL)
+            {
+                run(slot, future);
+            }
+        }
+
+        if (!(fds[0].revents & POLLIN) || read(pool->wake[0], &wake, 1) != 1)
+        {
+            continue;
+        }
+
+        // take the next request
+        pthread_mutex_lock(&pool->lock);
+        client_future *future = dequeue(&pool->head, &pool->tail);
+        int closing = pool->closing;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (future == NULL)
+        {
+            if (closing)
+            {
+                break;
+            }
+            continue;
+        }
+        run(slot, future);
+    }
+
+    // finish the slot's own requests, they were queued before the pool was freed
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        client_future *future = dequeue(&slot->head, &slot->tail);
+        pthread_mutex_unlock(&pool->lock);
+        if (future == NULL)
+        {
+            break;
+        }
+        run(slot, future);
+    }
+
+    // disconnect gracefully
+    if (slot->bio != NULL)
+    {
+        if (BIO_write(slot->bio, "DISCONNECT", strlen("DISCONNECT")) > 0)
+        {
+            slot_read(slot, buffer, 0);
+        }
+        slot_close(slot);
+    }
+    return NULL;
+}
+
+// runs a request, reconnecting with backoff if the connection fails
+// a request that reached the server is only retried when repeating it is harmless, as a reconnect starts a new session
+static void run(client_slot *slot, client_future *future)
+{
+    int status = -1;
+    for (int attempt = 0; attempt < CLIENT_RETRIES && status < 0; attempt++)
+    {
+        if (attempt > 0)
+        {
+            usleep(100000 << (attempt - 1));
+        }
+        if (slot->bio == NULL && slot_connect(slot) < 0)
+        {
+            continue;
+        }
+        if (slot_exchange(slot, future) < 0)
+        {
+            slot_close(slot);
+            if (!idempotent(future->command))
+            {
+                break;
+            }
+            continue;
+        }
+        status = 1;
+    }
+    complete(future, status);
+}
+
+// opens the slot's connection, sends CONNECT & restores its options and watches
+static int slot_connect(client_slot *slot)
+{
+    client_pool *pool = slot->pool;
+    char buffer[MAX_BUFFER];
+
+    if (strncmp(pool->target, "unix:", 5) == 0)
+    {
+        slot->bio = unix_connect(&pool->target[5]);
+        slot->ssl = NULL;
+    }
+    else
+    {
+        slot->bio = tls_connect(pool->ctx, pool->target, &slot->ssl, slot->session);
+    }
+    if (slot->bio == NULL)
+    {
+        // tls_connect freed the SSL it set up
+        slot->ssl = NULL;
+        return -1;
+    }
+
+    // the first connection holds the private session, the others only run shared commands so take no session
+    if (slot->id == 0)
+    {
+        snprintf(buffer, MAX_BUFFER, "CONNECT %.*s", MAX_BUFFER - 16, pool->client_id);
+    }
+    else
+    {
+        strcpy(buffer, "CONNECT");
+    }
+    if (BIO_write(slot->bio, buffer, strlen(buffer)) <= 0 || slot_read(slot, buffer, 0) < 0 || strcmp(buffer, "CONNECT: OK") != 0)
+    {
+        slot_close(slot);
+        return -1;
+    }
+
+    // the server forgets options & watches with the old connection
+    if (slot->wire_compress)
+    {
+        if (BIO_write(slot->bio, "OPTION COMPRESS", strlen("OPTION COMPRESS")) <= 0 || slot_read(slot, buffer, 0) < 0)
+        {
+            slot_close(slot);
+            return -1;
+        }
+    }
+    for (int i = 0; i < slot->n_watches; i++)
+    {
+        if (BIO_write(slot->bio, slot->watches[i], strlen(slot->watches[i])) <= 0 || slot_read(slot, buffer, 0) < 0)
+        {
+            slot_close(slot);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// reconnects a slot whose connection dropped while idle, so its watches are restored before anything is missed
+// the notify callback gets an ERROR message if that fails, the next request on the slot tries again
+static void slot_reconnect(client_slot *slot)
+{
+    client_pool *pool = slot->pool;
+    for (int attempt = 0; attempt < CLIENT_RETRIES; attempt++)
+    {
+        if (attempt > 0)
+        {
+            usleep(100000 << (attempt - 1));
+        }
+        if (slot_connect(slot) == 0)
+        {
+            return;
+        }
+    }
+
+    if (slot->n_watches > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        client_notify_callback callback = pool->on_notify;
+        void *arg = pool->notify_arg;
+        pthread_mutex_unlock(&pool->lock);
+        if (callback != NULL)
+        {
+            callback("ERROR: connection lost, watches not restored", arg);
+        }
+    }
+}
+
+// closes the slot's connection, keeping its TLS session to resume
+static void slot_close(client_slot *slot)
+{
+    if (slot->bio == NULL)
+    {
+        return;
+    }
+
+    if (slot->ssl != NULL)
+    {
+        // an unclean close would mark the session as not resumable
+        SSL_shutdown(slot->ssl);
+        SSL_SESSION *session = SSL_get1_session(slot->ssl);
+        if (session != NULL && SSL_SESSION_is_resumable(session))
+        {
+            SSL_SESSION_free(slot->session);
+            slot->session = session;
+        }
+        else
+        {
+            SSL_SESSION_free(session);
+        }
+    }
+
+    BIO_free_all(slot->bio);
+    slot->bio = NULL;
+    slot->ssl = NULL;
+
+    // a failed write may have left a SIGPIPE pending on this thread
+    clear_sigpipe();
+}
+
+// sends a request & reads its reply, sending the value after an ACK
+static int slot_exchange(client_slot *slot, client_future *future)
+{
+    char *reply = future->reply;
+
+    if (BIO_write(slot->bio, future->command, strlen(future->command)) <= 0 || slot_read(slot, reply, 0) < 0)
+    {
+        return -1;
+    }
+
+    if (strcmp(reply, "ACK") == 0 && future->has_value)
+    {
+        if (BIO_write(slot->bio, future->value, strlen(future->value)) <= 0 || slot_read(slot, reply, 0) < 0)
+        {
+            return -1;
+        }
+    }
+
+    // the server closes the connection after DISCONNECT
+    if (strcmp(reply, "DISCONNECT: OK") == 0)
+    {
+        slot_close(slot);
+        return 0;
+    }
+
+    // remember what must be restored after a reconnect
+    if (strcmp(reply, "OPTION: OK") == 0)
+    {
+        slot->wire_compress = 1;
+    }
+    else if ((strcmp(reply, "WATCH: OK") == 0 || strcmp(reply, "SWATCH: OK") == 0) && slot->n_watches < MAX_BUFFER)
+    {
+        slot->watches[slot->n_watches] = strdup(future->command);
+        if (slot->watches[slot->n_watches] != NULL)
+        {
+            slot->n_watches++;
+        }
+    }
+    else if (strcmp(reply, "UNWATCH: OK") == 0 || strcmp(reply, "SUNWATCH: OK") == 0)
+    {
+        // the matching watch is the command without UN
+        char watch[MAX_BUFFER];
+        if (future->command[0] == 'S')
+        {
+            watch[0] = 'S';
+            strcpy(&watch[1], &future->command[3]);
+        }
+        else
+        {
+            strcpy(watch, &future->command[2]);
+        }
+
+        for (int i = 0; i < slot->n_watches; i++)
+        {
+            if (strcmp(slot->watches[i], watch) == 0)
+            {
+                free(slot->watches[i]);
+                slot->watches[i] = slot->watches[--slot->n_watches];
+                break;
+            }
+        }
+    }
+    else if (slot->wire_compress && strncmp(future->command, "GET ", 4) == 0 && decode_value(reply) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// reads the next reply, passing any notifications before it to the pool's callback
+// when idle it returns 0 once no more notifications are waiting
+static int slot_read(client_slot *slot, char *buffer, int idle)
+{
+    client_pool *pool = slot->pool;
+    int n;
+
+    while (1)
+    {
+        memset(buffer, 0, MAX_BUFFER);
+        if ((n = BIO_read(slot->bio, buffer, MAX_BUFFER - 1)) <= 0 || ascii_buffer(buffer) < 0)
+        {
+            return -1;
+        }
+        if (strncmp(buffer, "NOTIFY: ", 8) != 0)
+        {
+            return n;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        client_notify_callback callback = pool->on_notify;
+        void *arg = pool->notify_arg;
+        pthread_mutex_unlock(&pool->lock);
+        if (callback != NULL)
+        {
+            callback(buffer, arg);
+        }
+
+        // only wanted a notification while idle
+        if (idle && (slot->ssl == NULL || SSL_pending(slot->ssl) == 0) && BIO_pending(slot->bio) == 0)
+        {
+            struct pollfd fds;
+            if (BIO_get_fd(slot->bio, &fds.fd) < 0)
+            {
+                return -1;
+            }
+            fds.events = POLLIN;
+            if (poll(&fds, 1, 0) == 0)
+            {
+                buffer[0] = '\0';
+                return 0;
+            }
+        }
+    }
+}
+
+// runs a request's callback, then marks it done for waiters & drops the pool's reference
+static void complete(client_future *future, int status)
+{
+    if (future->callback != NULL)
+    {
+        future->callback(future, status > 0 ? future->reply : NULL, future->arg);
+    }
+
+    pthread_mutex_lock(&future->lock);
+    future->status = status;
+    pthread_cond_broadcast(&future->done);
+    pthread_mutex_unlock(&future->lock);
+    client_future_free(future);
+}
+
+// appends a request to a queue, called with the pool locked
+static void enqueue(client_future **head, client_future **tail, client_future *future)
+{
+    if (*tail == NULL)
+    {
+        *head = future;
+    }
+    else
+    {
+        (*tail)->next = future;
+    }
+    *tail = future;
+}
+
+// takes the first request from a queue, NULL if it is empty, called with the pool locked
+static client_future *dequeue(client_future **head, client_future **tail)
+{
+    client_future *future = *head;
+    if (future != NULL)
+    {
+        *head = future->next;
+        if (*head == NULL)
+        {
+            *tail = NULL;
+        }
+    }
+    return future;
+}
+
+// checks if a command uses the private session or per connection state, so must run on the first connection
+// only shared namespace reads & writes and server reports may run on any connection
+static int session_command(char *command)
+{
+    return strncmp(command, "SPUT ", 5) != 0 && strncmp(command, "SGET ", 5) != 0 && strncmp(command, "SDELETE ", 8) != 0
+        && strcmp(command, "STATS") != 0 && strcmp(command, "REPLICATION") != 0;
+}
+
+// checks if a command gives the same result when repeated on a new connection
+static int idempotent(char *command)
+{
+    return strncmp(command, "SPUT ", 5) == 0 || strncmp(command, "SGET ", 5) == 0
+        || strcmp(command, "STATS") == 0 || strcmp(command, "REPLICATION") == 0;
+}
+
+// connects to the server over TLS, resuming session if there is one
+static BIO *tls_connect(SSL_CTX *ctx, char *host_port, SSL **ssl, SSL_SESSION *session)
+{
+    // Initialise OpenSSL socket
+    BIO *bio = BIO_new_ssl_connect(ctx);
+    if (bio == NULL)
+    {
+        fprintf(stderr, "Error initalising BIO socket\n");
+        return NULL;
+    }
+
+    // Initialise SSL
+    if (BIO_get_ssl(bio, ssl) <= 0)
+    {
+        fprintf(stderr, "Error initialising ssl\n");
+        BIO_free_all(bio);
+        return NULL;
+    }
+
+    SSL_set_mode(*ssl, SSL_MODE_AUTO_RETRY);
+    if (session != NULL)
+    {
+        SSL_set_session(*ssl, session);
+    }
+    if(BIO_set_conn_hostname(bio, host_port) <= 0)
+    {
+        fprintf(stderr, "Error adding hostname\n");
+        BIO_free_all(bio);
+        return NULL;
+    }
+
+    // Connect to server
+    if (BIO_do_connect(bio) <= 0)
+    {
+        fprintf(stderr, "Error connecting to server\n");
+        BIO_free_all(bio);
+        return NULL;
+    }
+
+    // Perform TLS handshake
+    if (BIO_do_handshake(bio) <= 0)
+    {
+        fprintf(stderr, "Error on TLS handshake\n");
+        BIO_free_all(bio);
+        return NULL;
+    }
+
+    return bio;
+}
+
+// connects to the server's unix socket, no TLS as the server checks who we are with SO_PEERCRED
+static BIO *unix_connect(char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error socket path too long\n");
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // SOCK_SEQPACKET keeps message boundaries the same as TLS records
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "Error connecting to server\n");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    BIO *bio = BIO_new_socket(fd, BIO_CLOSE);
+    if (bio == NULL)
+    {
+        fprintf(stderr, "Error initalising BIO socket\n");
+        close(fd);
+    }
+    return bio;
+}
+
+// replaces a RAW 'value' or ZLIB 'length' 'base64' GET reply with the plain value, other replies are never prefixed
+static int decode_value(char *buffer)
+{
+    unsigned char compressed[MAX_BUFFER];
+    uLongf raw_len;
+    int prefix, encoded_len, compressed_len;
+
+    if (strncmp(buffer, "RAW ", 4) == 0)
+    {
+        memmove(buffer, &buffer[4], strlen(&buffer[4]) + 1);
+        return 0;
+    }
+
+    if (strncmp(buffer, "ZLIB ", 5) != 0)
+    {
+        return 0;
+    }
+    if (sscanf(buffer, "ZLIB %lu %n", &raw_len, &prefix) != 1 || raw_len >= MAX_BUFFER)
+    {
+        return -1;
+    }
+
+    // base64 decode, dropping the bytes that stand for padding
+    char *encoded = &buffer[prefix];
+    encoded_len = strlen(encoded);
+    if ((compressed_len = EVP_DecodeBlock(compressed, (unsigned char *) encoded, encoded_len)) < 0)
+    {
+        return -1;
+    }
+    for (int i = encoded_len - 1; i >= 0 && encoded[i] == '='; i--)
+    {
+        compressed_len--;
+    }
+
+    if (uncompress((Bytef *) buffer, &raw_len, compressed, compressed_len) != Z_OK)
+    {
+        return -1;
+    }
+    buffer[raw_len] = '\0';
+    return 0;
+}
+
+// checks buffer contains only ASCII characters
+static int ascii_buffer(char *buffer)
+{
+    for (int i = 0; i < strlen(buffer); i++)
+    {
+        if (!isascii(buffer[i]))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// discards a SIGPIPE pending on this thread, where it is blocked
+static void clear_sigpipe(void)
+{
+    sigset_t sigpipe;
+    struct timespec none = {0, 0};
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    sigtimedwait(&sigpipe, NULL, &none);
+}
@@ -0,0 +1,60 @@
+#ifndef CLIENT_LIB_H
+#define CLIENT_LIB_H
+
+/*-------------------------
+| CONSTS
+|-------------------------*/
+#define MAX_BUFFER 256
+#define CLIENT_RETRIES 3 // attempts per request that is safe to repeat, reconnecting in between
+
+/*-------------------------
+| TYPES
+| - a pool of persistent
+|   connections shared by
+|   any number of threads
+|-------------------------*/
+typedef struct client_pool client_pool;
+typedef struct client_future client_future;
+
+// called on a pool thread when a request completes, reply is NULL if it failed
+typedef void (*client_callback)(client_future *future, char *reply, void *arg);
+
+// called on a pool thread for each NOTIFY message pushed by the server
+// or with an ERROR message when a dropped connection could not be restored, so its watches are no longer active
+typedef void (*client_notify_callback)(char *notification, void *arg);
+
+/*-------------------------
+| POOL
+|-------------------------*/
+
+// connects 'size' connections to target, "host:port" for TLS or "unix:path" for the unix socket
+// the first connection sends CONNECT 'client_id' & holds the private session, one of the server's 5 sessions
+// the others send CONNECT without a client_id, so they take no session & only run shared commands
+client_pool *client_pool_new(char *target, char *client_id, int size);
+
+// finishes queued requests, disconnects & frees the pool
+void client_pool_free(client_pool *pool);
+
+// sets the callback for notifications from WATCH & SWATCH
+void client_pool_on_notify(client_pool *pool, client_notify_callback callback, void *arg);
+
+/*-------------------------
+| REQUESTS
+|-------------------------*/
+
+// queues a command, value is sent after the server's ACK for PUT & SPUT and is otherwise NULL
+// SPUT, SGET, SDELETE, STATS & REPLICATION run on any connection, all other commands run in order on the first one
+// if the connection fails after the command was sent, only SPUT, SGET, STATS & REPLICATION are retried
+// callback may be NULL, the future must always be released with client_future_free
+client_future *client_send(client_pool *pool, char *command, char *value, client_callback callback, void *arg);
+
+// waits for a request, copying its reply into reply (MAX_BUFFER bytes), -1 if it failed
+int client_wait(client_future *future, char *reply);
+
+// releases a future, safe to call before the request completes
+void client_future_free(client_future *future);
+
+// sends a command & waits for the reply
+int client_call(client_pool *pool, char *command, char *value, char *reply);
+
+#endif
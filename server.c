@@ -1,8 +1,20 @@
+#define _GNU_SOURCE // struct ucred for SO_PEERCRED
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <signal.h>
+#include <zlib.h>
 #include <openssl/evp.h>
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
@@ -12,18 +24,54 @@
 | CONSTS
 |-------------------------*/
 #define MAX_SESSIONS 5
+#define MAX_SHARED_CONNS 64 // connections without a private session, such as client pool helpers
 #define MAX_BUFFER 256
+#define SCAN_LIMIT 16 // default number of keys per SCAN/RANGE page
+#define MAX_KEY (MAX_BUFFER - 1 - 16) // longest private or shared key, so any key fits a page after "RANGE: MORE\n" and a "NOTIFY: SDELETE " frame
+#define WATCH_BUCKETS 256 // buckets in the watcher index
+#define WATCH_QUEUE 64 // pending notifications per connection before overflow
+#define SHARED_SHARDS 16 // independently locked parts of the shared namespace
+#define SHARED_BUCKETS 1024 // hash buckets per shard
+#define SHARED_NAMESPACE "\n" // watcher namespace of shared keys, never a client_id as newlines are stripped
+#define REPL_LOG_SIZE 4096 // shared namespace changes kept for followers to catch up from
+#define REPL_BATCH 16000 // max bytes of a replication frame, so it fits in one TLS record
+#define REPL_COPY (REPL_BATCH / (2 * MAX_BUFFER + 4)) // log entries copied out per batch, so they always fit in a frame
+#define MAX_FOLLOWERS 4 // replicas served at once, as REPLICATE needs no session & each gets a thread & snapshot
+#define HANDOVER_DRAIN 30 // seconds a replaced server waits for its sessions to disconnect
+#define TICKET_KEYS_LEN 80 // bytes of TLS session ticket keys
+#define TRACE_RING 4096 // spans buffered per thread before new ones are dropped
+#define TRACE_RATE 100 // default 1 in n requests traced
 
 /*-------------------------
 | PRE-DECLARATIONS
 | - main() dependencies
 |-------------------------*/
-void *client_handler(void *ssl);
+void *client_handler(void *client);
+int unix_listen(char *path);
+void *unix_listener(void *listen_fd);
+int listener_wait(int fd);
+int peer_authorised(int fd);
+void *handover_listener(void *listen_fd);
+void handover_drain(void);
+int trace_open(char *path, int append);
+int trace_next(void);
+void trace_span(const char *name, const char *detail, struct timespec *start);
+void trace_release(void *ring);
+void trace_drain(void);
+void trace_write(char *line, int len);
+void *trace_drainer(void *arg);
 void strip_nl(char *buffer);
 int ascii_buffer(char *buffer);
 int get_session(char *client_id);
 void remove_session(char *client_id);
 int remove_data(char *client_id, char *key, int shift_items);
+int build_index(int session);
+int index_search(int session, char *key, int *found);
+int index_insert(int session, char *key);
+void index_remove(int session, char *key);
+void drop_index(int session);
+int scan_page(int session, char *argument, int range, char *page);
+long elapsed_ns(struct timespec *start);
 
 /*-------------------------
 | STRUCTS
@@ -33,7 +81,10 @@ int remove_data(char *client_id, char *key, int shift_items);
 // client data
 typedef struct {
     char *key;
-    char *value;
+    char *value; // raw string, or zlib data when compressed
+    int raw_len; // length of the raw string
+    int stored_len; // bytes allocated for value
+    int compressed;
 } client_data;
 
 // current client sessions
@@ -41,10 +92,128 @@ typedef struct {
     char *client_id;
     int allowance;
     client_data *data;
+    char **index; // keys in sorted order, built on first SCAN or RANGE
+    int indexed;
 } client_session;
 
 client_session sessions[MAX_SESSIONS]; // array to hold session structs
 int n_sessions = 0; // keeps track of number of sessions
+int n_shared = 0; // connections without a private session, guarded by mutex
+
+// client connection, notifications are queued here by writers and sent by the connection's own thread
+typedef struct {
+    SSL *ssl; // NULL for plaintext unix socket connections
+    int fd;
+    int wake[2]; // pipe written to when notifications are queued
+    char *outbox[WATCH_QUEUE];
+    int n_outbox;
+    int overflow;
+} client_conn;
+
+// watched key, one per connection and key
+typedef struct watch_entry {
+    char *client_id;
+    char *key;
+    client_conn *conn;
+    struct watch_entry *next;
+} watch_entry;
+
+watch_entry *watches[WATCH_BUCKETS]; // watcher index hashed on client_id & key
+
+// shared key value pair, stored inline so a reader racing a writer only ever copies a bounded buffer
+typedef struct shared_entry {
+    struct shared_entry *next;
+    char key[MAX_BUFFER];
+    char value[MAX_BUFFER];
+} shared_entry;
+
+// part of the shared namespace, readers retry if seq was odd or changed while they read
+typedef struct {
+    unsigned int seq;
+    pthread_mutex_t lock; // serialises writers
+    shared_entry *buckets[SHARED_BUCKETS];
+    shared_entry *free_entries; // deleted entries are recycled, never freed, so readers can't fault
+} __attribute__((aligned(64))) shared_shard;
+
+shared_shard shared[SHARED_SHARDS]; // shared namespace readable & writable by all sessions
+
+// change to the shared namespace, shipped to followers
+typedef struct {
+    unsigned long seq;
+    char op; // 'P' for SPUT, 'D' for SDELETE
+    char key[MAX_BUFFER];
+    char value[MAX_BUFFER];
+} repl_entry;
+
+// follower connected to this server, tracked to report lag
+typedef struct repl_follower {
+    unsigned long acked; // last seq the follower has applied
+    int handover; // the new server taking over, the only follower a draining server waits for
+    struct repl_follower *next;
+} repl_follower;
+
+// snapshot being received by a follower, applied as a whole once it is complete
+typedef struct {
+    int loading; // between SNAPSHOT & SYNCED
+    shared_entry *entries;
+    int n_entries;
+    int size;
+} repl_stage;
+
+// sent to a new server along with the listening sockets
+typedef struct {
+    int has_unix; // the unix socket listener follows the TLS one
+    unsigned char ticket_keys[TICKET_KEYS_LEN]; // so clients can resume their TLS sessions with the new server
+} handover_msg;
+
+// timed part of a traced request
+typedef struct {
+    const char *name; // always a string literal
+    char detail[16]; // command or lock name, may be empty
+    long start_ns;
+    long duration_ns;
+} trace_event;
+
+// spans recorded by one thread, it only writes head & the drain thread only writes tail so neither locks
+typedef struct trace_ring {
+    unsigned long head; // next slot the owning thread writes
+    unsigned long dropped; // spans lost while the ring was full
+    int in_use; // claimed by a live thread, released when it exits so rings are reused
+    int id; // tid in the trace
+    struct trace_ring *next;
+    unsigned long tail __attribute__((aligned(64))); // next slot the drain thread reads, kept off the owner's cache line
+    trace_event events[TRACE_RING];
+} trace_ring;
+
+/*-------------------------
+| PRE-DECLARATIONS
+| - dependencies on the
+|   structs above
+|-------------------------*/
+int encode_value(client_data *encoded, char *value, long *compress_ns);
+void store_value(client_data *data, client_data *encoded, long compress_ns);
+void compress_release(void *stream);
+char *load_value(client_data *data, int wire_compress);
+void free_value(client_data *data);
+void end_session(client_session *c_session);
+client_conn *conn_new(SSL *ssl, int fd);
+void conn_free(client_conn *conn);
+int conn_read(client_conn *conn, char *buffer, int len);
+int conn_write(client_conn *conn, char *buffer, int len);
+int flush_notifications(client_conn *conn);
+int add_watch(client_conn *conn, char *client_id, char *key);
+int remove_watch(client_conn *conn, char *client_id, char *key);
+void notify_watchers(char *client_id, char *key, char *event);
+void shared_init(void);
+int shared_get(char *key, char *value);
+int shared_put(char *key, char *value);
+int shared_delete(char *key);
+void repl_append(char op, char *key, char *value);
+void replica_sender(client_conn *conn, int *synced);
+void *replica_follower(void *address);
+int handover_receive(char *path, SSL_CTX *ctx, int *listen_fd, int *unix_fd);
+trace_ring *trace_claim(void);
+void *handover_follow(void *handover_fd);
 
 /*-------------------------
 | MULTI-THREADING
@@ -52,19 +221,151 @@ int n_sessions = 0; // keeps track of number of sessions
 |   locks
 |-------------------------*/
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER; // guards watches & connection outboxes
+
+/*-------------------------
+| COMPRESSION
+| - values at or above the
+|   threshold are stored
+|   zlib compressed, stats
+|   are guarded by mutex
+|-------------------------*/
+int compress_threshold = 0; // 0 disables compression, set with -z
+long stat_values = 0, stat_compressed = 0; // values stored & how many are compressed
+long stat_raw_bytes = 0, stat_stored_bytes = 0; // memory needed raw vs. actually used
+long stat_compress_ops = 0, stat_compress_ns = 0;
+long stat_decompress_ops = 0, stat_decompress_ns = 0;
+__thread z_stream *value_stream = NULL; // this thread's deflate state, reset for each value
+pthread_key_t compress_key; // frees a thread's deflate state when it exits
+
+/*-------------------------
+| REPLICATION
+| - the primary logs shared
+|   namespace changes, a
+|   thread per follower
+|   ships them in batches
+|-------------------------*/
+repl_entry repl_log[REPL_LOG_SIZE]; // ring buffer indexed by seq
+unsigned long repl_seq = 0; // seq of the last logged change
+repl_follower *repl_followers = NULL; // nothing is logged while this is empty
+pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER; // guards the log & followers
+pthread_cond_t repl_cond = PTHREAD_COND_INITIALIZER; // signalled when a change is logged
+
+// follower state, a follower serves SGET but refuses SPUT & SDELETE from clients
+char *primary = NULL; // host:port of the primary, set with -f
+unsigned long primary_seq = 0, applied_seq = 0; // primary's latest seq & the last one applied here
+struct timespec last_batch; // when the last batch arrived
+
+/*-------------------------
+| HANDOVER
+| - a new server takes the
+|   listening sockets of the
+|   running one, which then
+|   stops accepting & drains
+|-------------------------*/
+int listeners[2] = {-1, -1}; // TLS & unix socket listeners
+handover_msg handover; // what is sent with the listeners
+int stop_pipe[2]; // readable once the listeners are handed over
+int handover_synced = 0; // the new server has acknowledged the snapshot, guarded by repl_mutex
+
+/*-------------------------
+| TRACING
+| - sampled requests record
+|   spans into a lock-free
+|   ring per thread, which
+|   a thread drains to the
+|   trace file
+|-------------------------*/
+int trace_fd = -1; // Chrome trace format JSON, set with -t, opened for appending
+int trace_rate = 0; // 1 in trace_rate requests is traced, 0 while tracing is off
+__thread int trace_sampled = 0; // the current request on this thread is traced
+__thread trace_ring *trace_local = NULL; // this thread's ring, claimed on its first span
+__thread unsigned int trace_state = 0; // this thread's sampling xorshift, seeded on first use
+trace_ring *trace_rings = NULL; // every ring, never freed so the drain thread can always read them
+int trace_ids = 0; // last ring id handed out
+pthread_key_t trace_key; // releases a thread's ring when it exits
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER; // serialises draining
+
+// untraced requests only pay for testing trace_sampled
+#define TRACE_SAMPLE() (trace_sampled = trace_rate > 0 && trace_next())
+#define TRACE_MARK(t) do { if (trace_sampled) clock_gettime(CLOCK_MONOTONIC, &t); } while (0)
+#define TRACE_START(t) struct timespec t = {0, 0}; TRACE_MARK(t)
+#define TRACE_END(name, detail, t) do { if (trace_sampled) trace_span(name, detail, &t); } while (0)
+#define TRACE_LOCK(lock, detail) do { TRACE_START(trace_wait); pthread_mutex_lock(lock); TRACE_END("lock wait", detail, trace_wait); } while (0)
 
 /*-------------------------
 | MAIN()
 |-------------------------*/
 int main(int argc, char *argv[])
 {
+    // read options
+    int opt;
+    char *unix_path = NULL, *handover_path = NULL, *trace_path = NULL;
+    int sample_rate = TRACE_RATE;
+    while ((opt = getopt(argc, argv, "z:u:f:H:t:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'z':
+                // compress values of at least this many bytes
+                compress_threshold = atoi(optarg);
+                if (compress_threshold > 0 && pthread_key_create(&compress_key, compress_release) != 0)
+                {
+                    fprintf(stderr, "Error initialising compression\n");
+                    return -1;
+                }
+                break;
+
+            case 'u':
+                // also listen for plaintext clients on this unix socket
+                unix_path = optarg;
+                break;
+
+            case 'f':
+                // follow a primary, serving reads of its shared namespace
+                primary = optarg;
+                break;
+
+            case 'H':
+                // take over from the server running with this handover socket, then hand over through it
+                handover_path = optarg;
+                break;
+
+            case 't':
+                // record spans of sampled requests to this file
+                trace_path = optarg;
+                break;
+
+            case 's':
+                // trace 1 in this many requests
+                sample_rate = atoi(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-z threshold] [-u socket_path] [-f primary_host:port] [-H handover_path] [-t trace_file] [-s sample_rate] port\n", argv[0]);
+                return -1;
+        }
+    }
+
     // check arg length
-    if (argc != 2)
+    if (argc - optind != 1)
     {
         fprintf(stderr, "Error insufficient arguments\n");
         return -1;
     }
 
+    // Start tracing
+    if (trace_path != NULL)
+    {
+        // a server taking over appends to the file the old one is still draining into
+        if (sample_rate < 1 || trace_open(trace_path, handover_path != NULL) < 0)
+        {
+            fprintf(stderr, "Error opening trace file\n");
+            return -1;
+        }
+        trace_rate = sample_rate;
+    }
+
     // Generate EC keys
     EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
     if (key_ctx == NULL)
@@ -135,36 +436,129 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    // Initialise OpenSSL listen socket
-    BIO *bio = BIO_new_accept(argv[1]);
-    if (bio == NULL)
+    // a client or follower going away mid write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Initialise shared namespace
+    shared_init();
+
+    // Take over the listening sockets & shared namespace of the running server
+    int listen_fd = -1, unix_fd = -1;
+    if (pipe(stop_pipe) < 0)
     {
-        fprintf(stderr, "Error initalising BIO socket\n");
+        fprintf(stderr, "Error initialising stop pipe\n");
         return -1;
     }
+    if (handover_path != NULL)
+    {
+        handover_receive(handover_path, ctx, &listen_fd, &unix_fd);
+    }
 
-    // Bind the socket
-    if (BIO_do_accept(bio) <= 0)
+    // Start following the primary
+    if (primary != NULL)
+    {
+        pthread_t follower_thread;
+        if (pthread_create(&follower_thread, NULL, replica_follower, (void *) primary) != 0)
+        {
+            fprintf(stderr, "Error producing thread\n");
+            return -1;
+        }
+        pthread_detach(follower_thread);
+    }
+
+    // Start unix socket listener for same host clients
+    if (unix_path == NULL && unix_fd >= 0)
+    {
+        close(unix_fd);
+        unix_fd = -1;
+    }
+    if (unix_path != NULL)
+    {
+        if (unix_fd < 0)
+        {
+            unix_fd = unix_listen(unix_path);
+        }
+        if (unix_fd < 0)
+        {
+            fprintf(stderr, "Error binding unix socket\n");
+            return -1;
+        }
+
+        pthread_t unix_thread;
+        if (pthread_create(&unix_thread, NULL, unix_listener, (void *) (intptr_t) unix_fd) != 0)
+        {
+            fprintf(stderr, "Error producing thread\n");
+            return -1;
+        }
+        pthread_detach(unix_thread);
+    }
+
+    // Initialise OpenSSL listen socket, unless it was handed over
+    if (listen_fd < 0)
+    {
+        BIO *bio = BIO_new_accept(argv[optind]);
+        if (bio == NULL)
+        {
+            fprintf(stderr, "Error initalising BIO socket\n");
+            return -1;
+        }
+
+        // Bind the socket
+        if (BIO_do_accept(bio) <= 0)
         {
             fprintf(stderr, "Error binding socket\n");
             return -1;
         }
+        listen_fd = BIO_get_fd(bio, NULL);
+    }
 
-    // Keep accepting new connections
-    while (1)
+    // Another process may accept from the same socket during a handover, so never block in accept
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+    // Start handover listener for the next server
+    if (handover_path != NULL)
+    {
+        int handover_fd = unix_listen(handover_path);
+        if (handover_fd < 0)
+        {
+            fprintf(stderr, "Error binding handover socket\n");
+            return -1;
+        }
+        listeners[0] = listen_fd;
+        listeners[1] = unix_fd;
+        handover.has_unix = unix_fd >= 0;
+        SSL_CTX_get_tlsext_ticket_keys(ctx, handover.ticket_keys, TICKET_KEYS_LEN);
+
+        pthread_t handover_thread;
+        if (pthread_create(&handover_thread, NULL, handover_listener, (void *) (intptr_t) handover_fd) != 0)
+        {
+            fprintf(stderr, "Error producing thread\n");
+            return -1;
+        }
+        pthread_detach(handover_thread);
+    }
+
+    // Keep accepting new connections until handed over
+    while (listener_wait(listen_fd) == 0)
     {
         // Accept incoming connections
-        if (BIO_do_accept(bio) <= 0)
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd < 0)
         {
-            fprintf(stderr, "Error accepting connection\n");
+            // the other server took it during a handover
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                fprintf(stderr, "Error accepting connection\n");
+            }
             continue;
         }
 
         // Get the client BIO
-        BIO *client_bio = BIO_pop(bio);
+        BIO *client_bio = BIO_new_socket(client_fd, BIO_CLOSE);
         if (client_bio == NULL)
         {
             fprintf(stderr, "Error getting client BIO\n");
+            close(client_fd);
             continue;
         }
 
@@ -179,7 +573,11 @@ int main(int argc, char *argv[])
 
         // Wrap BIO in SSL
         SSL_set_bio(ssl, client_bio, client_bio);
-        if (SSL_accept(ssl) <= 0)
+        TRACE_SAMPLE();
+        TRACE_START(handshake);
+        int accepted = SSL_accept(ssl);
+        TRACE_END("handshake", accepted > 0 ? (SSL_session_reused(ssl) ? "resumed" : "full") : "failed", handshake);
+        if (accepted <= 0)
         {
             fprintf(stderr, "Error applying SSL\n");
             BIO_free(client_bio);
@@ -187,15 +585,28 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        client_conn *conn = conn_new(ssl, SSL_get_fd(ssl));
+        if (conn == NULL)
+        {
+            fprintf(stderr, "Error initialising connection\n");
+            SSL_free(ssl);
+            continue;
+        }
+
         pthread_t thread;
-        if (pthread_create(&thread, NULL, client_handler, (void *) ssl) != 0)
+        if (pthread_create(&thread, NULL, client_handler, (void *) conn) != 0)
         {
             fprintf(stderr, "Error producing thread\n");
-            SSL_free(ssl);
+            conn_free(conn);
         } else {
             pthread_detach(thread);
         }
     }
+
+    // The new server is accepting, finish with the sessions still connected here
+    close(listen_fd);
+    handover_drain();
+    trace_drain();
     return 0;
 }
 
@@ -204,19 +615,22 @@ int main(int argc, char *argv[])
 |-------------------------*/
 
 // handles client sessions
-void *client_handler(void *ssl)
+void *client_handler(void *client)
 {
     // Initalise variables
-    SSL *client = (SSL *) ssl;
+    client_conn *conn = (client_conn *) client;
     char buffer[MAX_BUFFER], *command, *argument;
     int session, cmd_len, arg_len, arg, exists;
+    client_data encoded; // a PUT value, compressed before the session lock is taken
+    long compress_ns;
+    int wire_compress = 0; // set by OPTION COMPRESS, GET may then send compressed values as is
 
     // read first message, ensure CONNECT before starting new thread
     memset(buffer, 0, MAX_BUFFER);
-    if (SSL_read(client, buffer, MAX_BUFFER - 1) <= 0)
+    if (conn_read(conn, buffer, MAX_BUFFER - 1) <= 0)
     {
         fprintf(stderr, "Error reading CONNECT\n");
-        SSL_free(client);
+        conn_free(conn);
         return NULL;
     }
 
@@ -226,14 +640,40 @@ void *client_handler(void *ssl)
     // check message is ASCII only
     if (ascii_buffer(buffer) < 0)
     {
-        SSL_free(client);
+        conn_free(conn);
+        return NULL;
+    }
+
+    // a follower replicating the shared namespace instead of a client
+    if (strcmp(buffer, "REPLICATE") == 0)
+    {
+        replica_sender(conn, NULL);
+        conn_free(conn);
         return NULL;
     }
 
+    // CONNECT without a client_id only runs shared namespace commands, so it takes no session
+    client_session c_session;
+    c_session.client_id = NULL;
+    if (strcmp(buffer, "CONNECT") == 0)
+    {
+        pthread_mutex_lock(&mutex);
+        if (n_shared == MAX_SHARED_CONNS)
+        {
+            pthread_mutex_unlock(&mutex);
+            conn_write(conn, "CONNECT: ERROR", strlen("CONNECT: ERROR"));
+            conn_free(conn);
+            return NULL;
+        }
+        n_shared++;
+        pthread_mutex_unlock(&mutex);
+        goto connected;
+    }
+
     // check argument is CONNECT with space
     if (n_sessions == 5 || strncmp(buffer, "CONNECT ", 8) != 0)
     {
-        SSL_free(client);
+        conn_free(conn);
         return NULL;
     }
 
@@ -242,50 +682,63 @@ void *client_handler(void *ssl)
     if (get_session(&buffer[strlen("CONNECT ")]) >= 0)
     {
         pthread_mutex_unlock(&mutex);
-        SSL_write(client, "CONNECT: ERROR", strlen("CONNECT: ERROR"));
-        SSL_free(client);
+        conn_write(conn, "CONNECT: ERROR", strlen("CONNECT: ERROR"));
+        conn_free(conn);
         return NULL;
     }
     pthread_mutex_unlock(&mutex);
 
     // add client session
-    client_session c_session;
     c_session.client_id = malloc((strlen(&buffer[strlen("CONNECT ")]) + 1) * sizeof(char));
     c_session.data = malloc(1);
     if (c_session.client_id == NULL || c_session.data == NULL)
     {
-        SSL_write(client, "CONNECT: ERROR", strlen("CONNECT: ERROR"));
-        SSL_free(client);
+        conn_write(conn, "CONNECT: ERROR", strlen("CONNECT: ERROR"));
+        conn_free(conn);
         free(c_session.client_id);
         free(c_session.data);
         return NULL;
     }
     strcpy(c_session.client_id, &buffer[strlen("CONNECT ")]);
     c_session.allowance = 0;
+    c_session.index = NULL;
+    c_session.indexed = 0;
     pthread_mutex_lock(&mutex);
+
+    // another connection may have taken the last session or this client_id since the check above
+    if (n_sessions == MAX_SESSIONS || get_session(c_session.client_id) >= 0)
+    {
+        pthread_mutex_unlock(&mutex);
+        conn_write(conn, "CONNECT: ERROR", strlen("CONNECT: ERROR"));
+        conn_free(conn);
+        free(c_session.client_id);
+        free(c_session.data);
+        return NULL;
+    }
     sessions[n_sessions] = c_session;
     n_sessions++;
     pthread_mutex_unlock(&mutex);
 
     // acknowledge connect
-    if(SSL_write(client, "CONNECT: OK", strlen("CONNECT: OK")) <= 0)
+    connected:
+    if (conn_write(conn, "CONNECT: OK", strlen("CONNECT: OK")) <= 0)
     {
-        pthread_mutex_lock(&mutex);
-        remove_session(c_session.client_id);
-        pthread_mutex_unlock(&mutex);
-        SSL_free(client);
+        end_session(&c_session);
+        conn_free(conn);
         return NULL;
     }
 
     // continue handling messages until DISCONNECT
     while (1)
     {
-        // receive messages
+        // receive messages, sending any notifications while idle
+        TRACE_SAMPLE();
         memset(buffer, 0, MAX_BUFFER);
-        if (SSL_read(client, buffer, MAX_BUFFER - 1) <= 0)
+        if (conn_read(conn, buffer, MAX_BUFFER - 1) <= 0)
         {
             break;
         }
+        TRACE_START(parse);
 
         // replace \n & \r with \0
         strip_nl(buffer);
@@ -308,19 +761,19 @@ void *client_handler(void *ssl)
         // disconnect if commanded, otherwise get argument
         if (strcmp(command, "DISCONNECT") == 0)
         {
-            SSL_write(client, "DISCONNECT: OK", strlen("DISCONNECT: OK"));
+            conn_write(conn, "DISCONNECT: OK", strlen("DISCONNECT: OK"));
             free(command);
             break;
         }
         else
         {
-            arg_len = strlen(&buffer[cmd_len + 1]);
+            arg_len = strlen(&buffer[cmd_len]);
             if((argument = malloc((arg_len + 1) * sizeof(char))) == NULL)
             {
                 free(command);
                 break;
             }
-            strncpy(argument, &buffer[cmd_len + 1], arg_len);
+            strncpy(argument, &buffer[cmd_len], arg_len);
             argument[arg_len] = '\0';
         }
 
@@ -328,19 +781,61 @@ void *client_handler(void *ssl)
         strcmp(command, "PUT ") == 0 ? (arg = 1) :
         strcmp(command, "GET ") == 0 ? (arg = 2) :
         strcmp(command, "DELETE ") == 0? (arg = 3) :
+        strcmp(command, "SCAN ") == 0 ? (arg = 4) :
+        strcmp(command, "RANGE ") == 0 ? (arg = 5) :
+        strcmp(command, "WATCH ") == 0 ? (arg = 6) :
+        strcmp(command, "UNWATCH ") == 0 ? (arg = 7) :
+        strcmp(command, "SPUT ") == 0 ? (arg = 8) :
+        strcmp(command, "SGET ") == 0 ? (arg = 9) :
+        strcmp(command, "SDELETE ") == 0 ? (arg = 10) :
+        strcmp(command, "SWATCH ") == 0 ? (arg = 11) :
+        strcmp(command, "SUNWATCH ") == 0 ? (arg = 12) :
+        strcmp(command, "OPTION ") == 0 ? (arg = 13) :
+        strcmp(command, "STATS") == 0 ? (arg = 14) :
+        strcmp(command, "REPLICATION") == 0 ? (arg = 15) :
         (arg = -1);
 
+        // a connection without a session may only use the shared namespace & server reports
+        if (c_session.client_id == NULL && ((arg >= 1 && arg <= 7) || arg == 13))
+        {
+            arg = -1;
+        }
+
+        // command name for the spans below
+        char name[16] = "";
+        if (trace_sampled)
+        {
+            snprintf(name, sizeof(name), "%.*s", (int) strcspn(command, " "), command);
+        }
+        TRACE_END("parse", name, parse);
+
         free(command);
 
         // error handling for switch case
         int switch_err = 0;
 
+        // set to the event when a key is changed, watchers are notified after the lock is released
+        char *changed = NULL, *watch_ns = c_session.client_id;
+
+        // only the store operation itself is timed, not waiting on the client or locks
+        struct timespec store = {0, 0};
+        int result;
         switch(arg)
         {
             case 1:
                 // PUT command: add data
+                // refuse keys too long to come back from SCAN, RANGE or NOTIFY
+                if (strlen(argument) > MAX_KEY)
+                {
+                    if (conn_write(conn, "PUT: ERROR", strlen("PUT: ERROR")) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                    break;
+                }
+
                 // acknowledge PUT command
-                if (SSL_write(client, "ACK", 3) <= 0)
+                if (conn_write(conn, "ACK", 3) <= 0)
                 {
                     switch_err = 1;
                 }
@@ -349,7 +844,7 @@ void *client_handler(void *ssl)
                 {
                     // receive value
                     memset(buffer, 0, MAX_BUFFER);
-                    if (SSL_read(client, buffer, MAX_BUFFER - 1) <= 0)
+                    if (conn_read(conn, buffer, MAX_BUFFER - 1) <= 0)
                     {
                         switch_err = 1;
                         goto put_error;
@@ -362,8 +857,16 @@ void *client_handler(void *ssl)
                         break;
                     }
 
+                    // compress outside the lock, other sessions only wait for the swap
+                    if (encode_value(&encoded, buffer, &compress_ns) < 0)
+                    {
+                        switch_err = 1;
+                        goto put_error;
+                    }
+
                     // check if key exists
-                    pthread_mutex_lock(&mutex);
+                    TRACE_LOCK(&mutex, "mutex");
+                    TRACE_MARK(store);
                     session = get_session(c_session.client_id);
                     exists = 0;
                     for (int i = 0; i < sessions[session].allowance; i++)
@@ -372,16 +875,9 @@ void *client_handler(void *ssl)
                         if (strcmp(sessions[session].data[i].key, argument) == 0)
                         {
                             // change data
+                            // key is unchanged, so the ordered index stays valid
                             exists = 1;
-                            sessions[session].data[i].key = realloc(sessions[session].data[i].key, (arg_len + 1) * sizeof(char));
-                            sessions[session].data[i].value = realloc(sessions[session].data[i].value, (strlen(buffer) + 1) * sizeof(char));
-                            if (sessions[session].data[i].key == NULL || sessions[session].data[i].value == NULL)
-                            {
-                                switch_err = 1;
-                                goto put_error;
-                            }
-                            strcpy(sessions[session].data[i].key, argument);
-                            strcpy(sessions[session].data[i].value, buffer);
+                            store_value(&sessions[session].data[i], &encoded, compress_ns);
                             break;
                         }
                     }
@@ -393,22 +889,31 @@ void *client_handler(void *ssl)
                     // add data
                     client_data data;
                     data.key = malloc((arg_len + 1) * sizeof(char));
-                    data.value = malloc((strlen(buffer) + 1) * sizeof(char));
+                    data.value = NULL;
                     sessions[session].data = realloc(sessions[session].data, (sessions[session].allowance + 1) * sizeof(client_data));
-                    if (data.key == NULL || data.value == NULL || sessions[session].data == NULL)
+                    if (data.key == NULL || sessions[session].data == NULL)
                     {
+                        free(encoded.value);
                         switch_err = 1;
                         goto put_error;
                     }
+                    store_value(&data, &encoded, compress_ns);
                     strcpy(data.key, argument);
-                    strcpy(data.value, buffer);
                     sessions[session].data[sessions[session].allowance] = data;
                     sessions[session].allowance++;
+
+                    // keep the ordered index in step, rebuild it on next SCAN if that fails
+                    if (sessions[session].indexed && index_insert(session, data.key) < 0)
+                    {
+                        drop_index(session);
+                    }
                 }
+                TRACE_END("store", name, store);
 
                 if (!switch_err)
                 {
-                    if (SSL_write(client, "PUT: OK", strlen("PUT: OK")) <= 0)
+                    changed = "PUT";
+                    if (conn_write(conn, "PUT: OK", strlen("PUT: OK")) <= 0)
                     {
                         switch_err = 1;
                     }
@@ -418,7 +923,7 @@ void *client_handler(void *ssl)
                 if (switch_err)
                 {
                     switch_err = 0;
-                    if (SSL_write(client, "PUT: ERROR", strlen("PUT: ERROR")) <= 0)
+                    if (conn_write(conn, "PUT: ERROR", strlen("PUT: ERROR")) <= 0)
                     {
                         switch_err = 1;
                     }
@@ -429,57 +934,66 @@ void *client_handler(void *ssl)
 
             case 2:
                 // GET command
-                pthread_mutex_lock(&mutex);
-                session = get_session(c_session.client_id);
-                exists = 0;
-
-                // for all data items
-                for (int i = 0; i < sessions[session].allowance; i++)
                 {
-                    // if key in data array
-                    if (strcmp(sessions[session].data[i].key, argument) == 0)
+                    char *value = NULL;
+                    TRACE_LOCK(&mutex, "mutex");
+                    TRACE_MARK(store);
+                    session = get_session(c_session.client_id);
+
+                    // for all data items
+                    for (int i = 0; i < sessions[session].allowance; i++)
                     {
-                        exists = 1;
-                        if (SSL_write(client, sessions[session].data[i].value, strlen(sessions[session].data[i].value)) <= 0)
+                        // if key in data array, decompress it now it is needed
+                        if (strcmp(sessions[session].data[i].key, argument) == 0)
                         {
-                            switch_err = 1;
+                            value = load_value(&sessions[session].data[i], wire_compress);
+                            break;
                         }
-                        break;
                     }
-                }
+                    TRACE_END("store", name, store);
+                    pthread_mutex_unlock(&mutex);
 
-                if (switch_err || !exists)
-                {
-                    switch_err = 0;
-                    if (SSL_write(client, "GET: ERROR", strlen("GET: ERROR")) <= 0)
+                    if (value == NULL)
                     {
-                        switch_err = 1;
+                        if (conn_write(conn, "GET: ERROR", strlen("GET: ERROR")) <= 0)
+                        {
+                            switch_err = 1;
+                        }
+                    }
+                    else
+                    {
+                        if (conn_write(conn, value, strlen(value)) <= 0)
+                        {
+                            switch_err = 1;
+                        }
+                        free(value);
                     }
                 }
-
-                pthread_mutex_unlock(&mutex);
                 break;
 
             case 3:
                 // DELETE command
-                pthread_mutex_lock(&mutex);
+                TRACE_LOCK(&mutex, "mutex");
+                TRACE_MARK(store);
                 session = get_session(c_session.client_id);
                 if (remove_data(c_session.client_id, argument, 1) < 0)
                 {
                     switch_err = 1;
                 }
+                TRACE_END("store", name, store);
 
                 if (switch_err)
                 {
                     switch_err = 0;
-                    if (SSL_write(client, "DELETE: ERROR", strlen("DELETE: ERROR")) <= 0)
+                    if (conn_write(conn, "DELETE: ERROR", strlen("DELETE: ERROR")) <= 0)
                     {
                         switch_err = 1;
                     }
                 }
                 else
                 {
-                    if (SSL_write(client, "DELETE: OK", strlen("DELETE: OK")) <= 0)
+                    changed = "DELETE";
+                    if (conn_write(conn, "DELETE: OK", strlen("DELETE: OK")) <= 0)
                     {
                         switch_err = 1;
                     }
@@ -488,47 +1002,385 @@ void *client_handler(void *ssl)
                 pthread_mutex_unlock(&mutex);
                 break;
 
-            default:
-                // ERROR
-                switch_err = 1;
+            case 4:
+            case 5:
+                // SCAN & RANGE commands: one page of keys per command
+                {
+                    char page[MAX_BUFFER * 2];
+                    TRACE_LOCK(&mutex, "mutex");
+                    TRACE_MARK(store);
+                    session = get_session(c_session.client_id);
+                    if (scan_page(session, argument, arg == 5, page) < 0)
+                    {
+                        strcpy(page, arg == 5 ? "RANGE: ERROR" : "SCAN: ERROR");
+                    }
+                    TRACE_END("store", name, store);
+                    pthread_mutex_unlock(&mutex);
+
+                    // write without holding the lock so writers aren't blocked
+                    if (conn_write(conn, page, strlen(page)) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                }
                 break;
-        }
 
-        free(argument);
+            case 6:
+            case 11:
+                // WATCH & SWATCH commands: push a notification when the key is changed
+                TRACE_MARK(store);
+                result = add_watch(conn, arg == 11 ? SHARED_NAMESPACE : c_session.client_id, argument);
+                TRACE_END("store", name, store);
+                if (result < 0)
+                {
+                    if (conn_write(conn, arg == 11 ? "SWATCH: ERROR" : "WATCH: ERROR", arg == 11 ? strlen("SWATCH: ERROR") : strlen("WATCH: ERROR")) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                }
+                else if (conn_write(conn, arg == 11 ? "SWATCH: OK" : "WATCH: OK", arg == 11 ? strlen("SWATCH: OK") : strlen("WATCH: OK")) <= 0)
+                {
+                    switch_err = 1;
+                }
+                break;
 
-        // if error occured in switch
-        if (switch_err)
-        {
-            break;
-        }
-    }
+            case 7:
+            case 12:
+                // UNWATCH & SUNWATCH commands
+                TRACE_MARK(store);
+                result = remove_watch(conn, arg == 12 ? SHARED_NAMESPACE : c_session.client_id, argument);
+                TRACE_END("store", name, store);
+                if (result < 0)
+                {
+                    if (conn_write(conn, arg == 12 ? "SUNWATCH: ERROR" : "UNWATCH: ERROR", arg == 12 ? strlen("SUNWATCH: ERROR") : strlen("UNWATCH: ERROR")) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                }
+                else if (conn_write(conn, arg == 12 ? "SUNWATCH: OK" : "UNWATCH: OK", arg == 12 ? strlen("SUNWATCH: OK") : strlen("UNWATCH: OK")) <= 0)
+                {
+                    switch_err = 1;
+                }
+                break;
 
-    pthread_mutex_lock(&mutex);
-    remove_session(c_session.client_id);
-    pthread_mutex_unlock(&mutex);
-    SSL_free(client);
-    return NULL;
-}
+            case 8:
+                // SPUT command: add shared data, no session lock is needed
+                if (primary != NULL)
+                {
+                    // followers are read only
+                    if (conn_write(conn, "SPUT: ERROR", strlen("SPUT: ERROR")) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                    break;
+                }
+                if (conn_write(conn, "ACK", 3) <= 0)
+                {
+                    switch_err = 1;
+                    break;
+                }
 
-// replaces newlines and carriage returns with null terminator
-void strip_nl(char *buffer)
-{
-    buffer[strcspn(buffer, "\n")] = '\0';
-    buffer[strcspn(buffer, "\r")] = '\0';
-}
+                // receive value
+                memset(buffer, 0, MAX_BUFFER);
+                if (conn_read(conn, buffer, MAX_BUFFER - 1) <= 0)
+                {
+                    switch_err = 1;
+                    break;
+                }
+                strip_nl(buffer);
 
-// checks buffer contains only ASCII characters
-int ascii_buffer(char *buffer)
-{
-    for (int i = 0; i < strlen(buffer); i++)
-    {
-        if (!isascii(buffer[i]))
-        {
-            return -1;
-        }
-    }
-    return 0;
-}
+                // shared_put times its own store span, after the shard lock is taken
+                result = ascii_buffer(buffer) < 0 ? -1 : shared_put(argument, buffer);
+                if (result < 0)
+                {
+                    if (conn_write(conn, "SPUT: ERROR", strlen("SPUT: ERROR")) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                    break;
+                }
+
+                changed = "SPUT";
+                watch_ns = SHARED_NAMESPACE;
+                if (conn_write(conn, "SPUT: OK", strlen("SPUT: OK")) <= 0)
+                {
+                    switch_err = 1;
+                }
+                break;
+
+            case 9:
+                // SGET command: lock-free read of shared data
+                {
+                    char value[MAX_BUFFER];
+                    TRACE_MARK(store);
+                    result = shared_get(argument, value);
+                    TRACE_END("store", name, store);
+                    if (result < 0)
+                    {
+                        strcpy(value, "SGET: ERROR");
+                    }
+                    if (conn_write(conn, value, strlen(value)) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                }
+                break;
+
+            case 10:
+                // SDELETE command, followers are read only
+                // shared_delete times its own store span, after the shard lock is taken
+                result = primary != NULL ? -1 : shared_delete(argument);
+                if (result < 0)
+                {
+                    if (conn_write(conn, "SDELETE: ERROR", strlen("SDELETE: ERROR")) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                    break;
+                }
+
+                changed = "SDELETE";
+                watch_ns = SHARED_NAMESPACE;
+                if (conn_write(conn, "SDELETE: OK", strlen("SDELETE: OK")) <= 0)
+                {
+                    switch_err = 1;
+                }
+                break;
+
+            case 13:
+                // OPTION command: negotiate connection options
+                if (strcmp(argument, "COMPRESS") == 0)
+                {
+                    wire_compress = 1;
+                    if (conn_write(conn, "OPTION: OK", strlen("OPTION: OK")) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                }
+                else if (conn_write(conn, "OPTION: ERROR", strlen("OPTION: ERROR")) <= 0)
+                {
+                    switch_err = 1;
+                }
+                break;
+
+            case 14:
+                // STATS command: report compression savings & cost
+                {
+                    char stats[MAX_BUFFER];
+                    pthread_mutex_lock(&mutex);
+                    snprintf(stats, MAX_BUFFER, "STATS: values=%ld compressed=%ld raw_bytes=%ld stored_bytes=%ld saved_bytes=%ld compress_ns_per_op=%ld decompress_ns_per_op=%ld",
+                        stat_values, stat_compressed, stat_raw_bytes, stat_stored_bytes, stat_raw_bytes - stat_stored_bytes,
+                        stat_compress_ops ? stat_compress_ns / stat_compress_ops : 0,
+                        stat_decompress_ops ? stat_decompress_ns / stat_decompress_ops : 0);
+                    pthread_mutex_unlock(&mutex);
+                    if (conn_write(conn, stats, strlen(stats)) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                }
+                break;
+
+            case 15:
+                // REPLICATION command: report role & replica lag
+                {
+                    char report[MAX_BUFFER];
+                    pthread_mutex_lock(&repl_mutex);
+                    if (primary != NULL)
+                    {
+                        long ms = last_batch.tv_sec == 0 ? -1 : elapsed_ns(&last_batch) / 1000000;
+                        snprintf(report, MAX_BUFFER, "REPLICATION: role=follower primary=%s applied_seq=%lu primary_seq=%lu lag=%lu last_batch_ms=%ld",
+                            primary, applied_seq, primary_seq, primary_seq - applied_seq, ms);
+                    }
+                    else
+                    {
+                        int followers = 0;
+                        unsigned long max_lag = 0;
+                        for (repl_follower *follower = repl_followers; follower != NULL; follower = follower->next)
+                        {
+                            followers++;
+                            if (repl_seq - follower->acked > max_lag)
+                            {
+                                max_lag = repl_seq - follower->acked;
+                            }
+                        }
+                        snprintf(report, MAX_BUFFER, "REPLICATION: role=primary seq=%lu followers=%d max_lag=%lu", repl_seq, followers, max_lag);
+                    }
+                    pthread_mutex_unlock(&repl_mutex);
+                    if (conn_write(conn, report, strlen(report)) <= 0)
+                    {
+                        switch_err = 1;
+                    }
+                }
+                break;
+
+            default:
+                // ERROR
+                switch_err = 1;
+                break;
+        }
+
+        // queue notifications for watchers of the changed key
+        if (changed != NULL)
+        {
+            notify_watchers(watch_ns, argument, changed);
+        }
+
+        free(argument);
+
+        // if error occured in switch
+        if (switch_err)
+        {
+            break;
+        }
+    }
+
+    end_session(&c_session);
+    conn_free(conn);
+    return NULL;
+}
+
+// removes a connection's session, or releases its place if it had none
+void end_session(client_session *c_session)
+{
+    pthread_mutex_lock(&mutex);
+    if (c_session->client_id == NULL)
+    {
+        n_shared--;
+    }
+    else
+    {
+        remove_session(c_session->client_id);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+// binds a unix socket listener, SOCK_SEQPACKET keeps message boundaries the same as TLS records
+int unix_listen(char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // replace a socket left by a previous run, only the owner may connect
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || chmod(path, S_IRUSR | S_IWUSR) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// accepts plaintext unix socket clients run by the same user as the server
+void *unix_listener(void *listen_fd)
+{
+    int fd = (int) (intptr_t) listen_fd;
+
+    // shared with the new server during a handover, like the TLS listener
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    while (listener_wait(fd) == 0)
+    {
+        // Accept incoming connections
+        int client_fd = accept(fd, NULL, NULL);
+        if (client_fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                fprintf(stderr, "Error accepting unix connection\n");
+            }
+            continue;
+        }
+
+        // Authenticate by the peer's user, the kernel vouches for it so no handshake is needed
+        if (!peer_authorised(client_fd))
+        {
+            fprintf(stderr, "Error unix peer not authorised\n");
+            close(client_fd);
+            continue;
+        }
+
+        client_conn *conn = conn_new(NULL, client_fd);
+        if (conn == NULL)
+        {
+            fprintf(stderr, "Error initialising connection\n");
+            close(client_fd);
+            continue;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_handler, (void *) conn) != 0)
+        {
+            fprintf(stderr, "Error producing thread\n");
+            conn_free(conn);
+        } else {
+            pthread_detach(thread);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+// waits for a connection on a listening socket, -1 once the listeners are handed over
+int listener_wait(int fd)
+{
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_pipe[0];
+    fds[1].events = POLLIN;
+    while (poll(fds, 2, -1) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return (fds[1].revents & POLLIN) ? -1 : 0;
+}
+
+// checks a unix socket peer is run by the same user as the server or root
+int peer_authorised(int fd)
+{
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
+    {
+        return 0;
+    }
+    return cred.uid == getuid() || cred.uid == 0;
+}
+
+// replaces newlines and carriage returns with null terminator
+void strip_nl(char *buffer)
+{
+    buffer[strcspn(buffer, "\n")] = '\0';
+    buffer[strcspn(buffer, "\r")] = '\0';
+}
+
+// checks buffer contains only ASCII characters
+int ascii_buffer(char *buffer)
+{
+    for (int i = 0; i < strlen(buffer); i++)
+    {
+        if (!isascii(buffer[i]))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
 
 // gets the index of a client session in the sessions array
 int get_session(char *client_id)
@@ -548,41 +1400,29 @@ void remove_session(char *client_id)
 {
     // get the session index
     int session = get_session(client_id);
+    if (session < 0)
+    {
+        return;
+    }
 
     // for each data item in client data
     for (int i = 0; i < sessions[session].allowance; i++)
     {
         //remove data
-        remove_data(client_id, sessions[session].data[i].key, 0);
+        free(sessions[session].data[i].key);
+        free_value(&sessions[session].data[i]);
     }
-    // free memory
+    // free memory, client_id is the caller's copy so it isn't used after this
     free(sessions[session].client_id);
     free(sessions[session].data);
-    sessions[session].allowance = 0;
+    free(sessions[session].index);
 
-    // if not the last session in array
-    if (session < n_sessions - 1)
+    // shift the following sessions to the left
+    for (int i = session; i < n_sessions - 1; i++)
     {
-        // for the remaining sessions
-        for (int i = 0; i < n_sessions; i++)
-        {
-            // if last session in array
-            if (i == n_sessions - 1)
-            {
-                // free duplicate
-                for (int j = 0; j < sessions[i].allowance; j++)
-                {
-                    remove_data(sessions[i].client_id, sessions[i].data[j].key, 0);
-                }
-                sessions[i].client_id = NULL;
-                sessions[i].data = NULL;
-                sessions[i].allowance = 0;
-                break;
-            }
-            // shift sessions to left
-            sessions[i] = sessions[i + 1];
-        }
+        sessions[i] = sessions[i + 1];
     }
+
     // decrement n_sessions
     n_sessions--;
     return;
@@ -600,9 +1440,15 @@ int remove_data(char *client_id, char *key, int shift_items)
         // if the key matches the argument
         if (strcmp(sessions[session].data[i].key, key) == 0)
         {
+            // remove from the ordered index before the key is freed
+            if (sessions[session].indexed)
+            {
+                index_remove(session, sessions[session].data[i].key);
+            }
+
             // free the memory
             free(sessions[session].data[i].key);
-            free(sessions[session].data[i].value);
+            free_value(&sessions[session].data[i]);
 
             // if shifting items and not last item
             if (shift_items && i < sessions[session].allowance)
@@ -628,4 +1474,1680 @@ int remove_data(char *client_id, char *key, int shift_items)
         }
     }
     return -1;
-}
\ No newline at end of file
+}
+
+// compares two keys for qsort
+int compare_keys(const void *a, const void *b)
+{
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+// builds the sorted key index for a session
+int build_index(int session)
+{
+    char **index = malloc((sessions[session].allowance + 1) * sizeof(char *));
+    if (index == NULL)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < sessions[session].allowance; i++)
+    {
+        index[i] = sessions[session].data[i].key;
+    }
+    qsort(index, sessions[session].allowance, sizeof(char *), compare_keys);
+
+    free(sessions[session].index);
+    sessions[session].index = index;
+    sessions[session].indexed = 1;
+    return 0;
+}
+
+// finds the first index position with a key >= the given key
+int index_search(int session, char *key, int *found)
+{
+    int low = 0, high = sessions[session].allowance, mid, cmp;
+    *found = 0;
+
+    // binary search over the sorted keys
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        cmp = strcmp(sessions[session].index[mid], key);
+        if (cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            if (cmp == 0)
+            {
+                *found = 1;
+            }
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// inserts a newly added key into the index, called after allowance is incremented
+int index_insert(int session, char *key)
+{
+    int found, count = sessions[session].allowance - 1;
+    char **index = realloc(sessions[session].index, (count + 1) * sizeof(char *));
+    if (index == NULL)
+    {
+        return -1;
+    }
+    sessions[session].index = index;
+
+    // search the keys already indexed, then shift the tail right
+    sessions[session].allowance = count;
+    int pos = index_search(session, key, &found);
+    sessions[session].allowance = count + 1;
+    memmove(&index[pos + 1], &index[pos], (count - pos) * sizeof(char *));
+    index[pos] = key;
+    return 0;
+}
+
+// removes a key from the index, called before allowance is decremented
+void index_remove(int session, char *key)
+{
+    int found, pos = index_search(session, key, &found);
+    if (!found)
+    {
+        return;
+    }
+    memmove(&sessions[session].index[pos], &sessions[session].index[pos + 1], (sessions[session].allowance - pos - 1) * sizeof(char *));
+}
+
+// discards the index, it will be rebuilt on the next SCAN or RANGE
+void drop_index(int session)
+{
+    free(sessions[session].index);
+    sessions[session].index = NULL;
+    sessions[session].indexed = 0;
+}
+
+// writes one page of SCAN (prefix [limit] [cursor]) or RANGE (start end [limit] [cursor]) results
+// the page is a status line followed by one key per line, "MORE" means the last key is the next cursor
+int scan_page(int session, char *argument, int range, char *page)
+{
+    char *start, *end = NULL, *cursor = NULL, *next;
+    int limit = SCAN_LIMIT, found, pos, count = 0, more = 0, len;
+    size_t start_len;
+
+    // split arguments, the cursor is the rest of the line as keys may contain spaces
+    start = argument;
+    next = &argument[strcspn(argument, " ")];
+    if (next == start)
+    {
+        return -1;
+    }
+    if (*next != '\0')
+    {
+        *next++ = '\0';
+    }
+    if (range)
+    {
+        end = next;
+        next = &next[strcspn(next, " ")];
+        if (next == end)
+        {
+            return -1;
+        }
+        if (*next != '\0')
+        {
+            *next++ = '\0';
+        }
+    }
+    if (*next != '\0')
+    {
+        limit = atoi(next);
+        if (limit <= 0)
+        {
+            return -1;
+        }
+        next = &next[strcspn(next, " ")];
+        if (*next != '\0')
+        {
+            cursor = next + 1;
+        }
+    }
+    start_len = strlen(start);
+
+    if (!sessions[session].indexed && build_index(session) < 0)
+    {
+        return -1;
+    }
+
+    // resume after the cursor, or from the first key that could match
+    if (cursor != NULL && strcmp(cursor, start) >= 0)
+    {
+        pos = index_search(session, cursor, &found);
+        pos += found;
+    }
+    else
+    {
+        pos = index_search(session, start, &found);
+    }
+
+    strcpy(page, range ? "RANGE: " : "SCAN: ");
+    len = strlen(page) + strlen("MORE");
+    char *keys = &page[MAX_BUFFER];
+    keys[0] = '\0';
+    int keys_len = 0;
+
+    for (; pos < sessions[session].allowance; pos++)
+    {
+        char *key = sessions[session].index[pos];
+
+        // stop at the end of the prefix or range, [start, end)
+        if ((!range && strncmp(key, start, start_len) != 0) || (range && strcmp(key, end) >= 0))
+        {
+            break;
+        }
+
+        // stop once the page is full, clients read at most MAX_BUFFER - 1 bytes
+        int key_len = strlen(key) + 1;
+        if (count == limit || len + keys_len + key_len > MAX_BUFFER - 1)
+        {
+            // PUT refuses longer keys, so the first always fits
+            if (count == 0)
+            {
+                return -1;
+            }
+            more = 1;
+            break;
+        }
+        keys[keys_len] = '\n';
+        strcpy(&keys[keys_len + 1], key);
+        keys_len += key_len;
+        count++;
+    }
+
+    strcat(page, more ? "MORE" : "OK");
+    memmove(&page[strlen(page)], keys, keys_len + 1);
+    return 0;
+}
+
+// creates a connection over TLS, or plaintext on fd when ssl is NULL
+client_conn *conn_new(SSL *ssl, int fd)
+{
+    client_conn *conn = malloc(sizeof(client_conn));
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+    conn->ssl = ssl;
+    conn->fd = fd;
+    conn->n_outbox = 0;
+    conn->overflow = 0;
+    if (fd < 0 || pipe(conn->wake) < 0)
+    {
+        free(conn);
+        return NULL;
+    }
+
+    // writers must never block on a slow watcher
+    fcntl(conn->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(conn->wake[1], F_SETFL, O_NONBLOCK);
+    return conn;
+}
+
+// removes a connection's watches, frees any undelivered notifications & closes it
+void conn_free(client_conn *conn)
+{
+    pthread_mutex_lock(&watch_mutex);
+    for (int i = 0; i < WATCH_BUCKETS; i++)
+    {
+        watch_entry **entry = &watches[i];
+        while (*entry != NULL)
+        {
+            if ((*entry)->conn == conn)
+            {
+                watch_entry *removed = *entry;
+                *entry = removed->next;
+                free(removed->client_id);
+                free(removed->key);
+                free(removed);
+            }
+            else
+            {
+                entry = &(*entry)->next;
+            }
+        }
+    }
+    for (int i = 0; i < conn->n_outbox; i++)
+    {
+        free(conn->outbox[i]);
+    }
+    conn->n_outbox = 0;
+    pthread_mutex_unlock(&watch_mutex);
+
+    close(conn->wake[0]);
+    close(conn->wake[1]);
+
+    if (conn->ssl != NULL)
+    {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+    else
+    {
+        close(conn->fd);
+    }
+    free(conn);
+}
+
+// reads a message, sending queued notifications while waiting for it
+int conn_read(client_conn *conn, char *buffer, int len)
+{
+    struct pollfd fds[2];
+
+    // wait for the client or a writer, unless a record is already buffered
+    while (conn->ssl == NULL || SSL_pending(conn->ssl) == 0)
+    {
+        fds[0].fd = conn->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = conn->wake[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0)
+        {
+            return -1;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            if (flush_notifications(conn) < 0)
+            {
+                return -1;
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            break;
+        }
+    }
+    TRACE_START(read_start);
+    int n = conn->ssl == NULL ? read(conn->fd, buffer, len) : SSL_read(conn->ssl, buffer, len);
+    TRACE_END("read", "", read_start);
+    return n;
+}
+
+// writes a message, unix socket connections are SOCK_SEQPACKET so message boundaries are kept like TLS records
+int conn_write(client_conn *conn, char *buffer, int len)
+{
+    TRACE_START(write_start);
+    int n = conn->ssl == NULL ? send(conn->fd, buffer, len, MSG_NOSIGNAL) : SSL_write(conn->ssl, buffer, len);
+    TRACE_END("write", "", write_start);
+    return n;
+}
+
+// sends all queued notifications to the client
+int flush_notifications(client_conn *conn)
+{
+    char *outbox[WATCH_QUEUE], wake[WATCH_QUEUE];
+    int n_outbox, overflow, err = 0;
+
+    // take the queue so writers are only held up for the copy
+    pthread_mutex_lock(&watch_mutex);
+    while (read(conn->wake[0], wake, sizeof(wake)) > 0);
+    n_outbox = conn->n_outbox;
+    memcpy(outbox, conn->outbox, n_outbox * sizeof(char *));
+    overflow = conn->overflow;
+    conn->n_outbox = 0;
+    conn->overflow = 0;
+    pthread_mutex_unlock(&watch_mutex);
+
+    for (int i = 0; i < n_outbox; i++)
+    {
+        if (!err && conn_write(conn, outbox[i], strlen(outbox[i])) <= 0)
+        {
+            err = 1;
+        }
+        free(outbox[i]);
+    }
+
+    // notifications were dropped, the client should re-read what it watches
+    if (!err && overflow && conn_write(conn, "NOTIFY: OVERFLOW", strlen("NOTIFY: OVERFLOW")) <= 0)
+    {
+        err = 1;
+    }
+    return err ? -1 : 0;
+}
+
+// hashes a client_id & key into the watcher index
+unsigned int watch_hash(char *client_id, char *key)
+{
+    unsigned int hash = 5381;
+    for (char *c = client_id; *c != '\0'; c++)
+    {
+        hash = hash * 33 + *c;
+    }
+    hash = hash * 33;
+    for (char *c = key; *c != '\0'; c++)
+    {
+        hash = hash * 33 + *c;
+    }
+    return hash % WATCH_BUCKETS;
+}
+
+// registers a connection's interest in a key
+int add_watch(client_conn *conn, char *client_id, char *key)
+{
+    unsigned int bucket = watch_hash(client_id, key);
+
+    // the key has to fit in a NOTIFY frame the client can read
+    if (strlen(key) > MAX_KEY)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&watch_mutex);
+
+    // already watching
+    for (watch_entry *entry = watches[bucket]; entry != NULL; entry = entry->next)
+    {
+        if (entry->conn == conn && strcmp(entry->client_id, client_id) == 0 && strcmp(entry->key, key) == 0)
+        {
+            pthread_mutex_unlock(&watch_mutex);
+            return 0;
+        }
+    }
+
+    watch_entry *entry = malloc(sizeof(watch_entry));
+    if (entry == NULL || (entry->client_id = strdup(client_id)) == NULL)
+    {
+        pthread_mutex_unlock(&watch_mutex);
+        free(entry);
+        return -1;
+    }
+    if ((entry->key = strdup(key)) == NULL)
+    {
+        pthread_mutex_unlock(&watch_mutex);
+        free(entry->client_id);
+        free(entry);
+        return -1;
+    }
+    entry->conn = conn;
+    entry->next = watches[bucket];
+    watches[bucket] = entry;
+
+    pthread_mutex_unlock(&watch_mutex);
+    return 0;
+}
+
+// removes a connection's interest in a key
+int remove_watch(client_conn *conn, char *client_id, char *key)
+{
+    unsigned int bucket = watch_hash(client_id, key);
+
+    pthread_mutex_lock(&watch_mutex);
+    for (watch_entry **entry = &watches[bucket]; *entry != NULL; entry = &(*entry)->next)
+    {
+        if ((*entry)->conn == conn && strcmp((*entry)->client_id, client_id) == 0 && strcmp((*entry)->key, key) == 0)
+        {
+            watch_entry *removed = *entry;
+            *entry = removed->next;
+            pthread_mutex_unlock(&watch_mutex);
+            free(removed->client_id);
+            free(removed->key);
+            free(removed);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&watch_mutex);
+    return -1;
+}
+
+// queues a notification for every connection watching a key and wakes them
+void notify_watchers(char *client_id, char *key, char *event)
+{
+    unsigned int bucket = watch_hash(client_id, key);
+
+    TRACE_LOCK(&watch_mutex, "watch");
+    for (watch_entry *entry = watches[bucket]; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->client_id, client_id) != 0 || strcmp(entry->key, key) != 0)
+        {
+            continue;
+        }
+
+        // a full queue drops the notification rather than stalling the writer
+        client_conn *conn = entry->conn;
+        // keys are at most MAX_KEY, so every frame fits in one client read
+        char *frame = malloc(MAX_BUFFER);
+        if (frame == NULL || conn->n_outbox == WATCH_QUEUE)
+        {
+            free(frame);
+            conn->overflow = 1;
+        }
+        else
+        {
+            snprintf(frame, MAX_BUFFER, "NOTIFY: %s %s", event, key);
+            conn->outbox[conn->n_outbox++] = frame;
+        }
+
+        // the pipe is non-blocking, a full pipe already means a wake is pending
+        write(conn->wake[1], "!", 1);
+    }
+    pthread_mutex_unlock(&watch_mutex);
+}
+
+// initialises the shared namespace shards
+void shared_init(void)
+{
+    for (int i = 0; i < SHARED_SHARDS; i++)
+    {
+        shared[i].seq = 0;
+        pthread_mutex_init(&shared[i].lock, NULL);
+        memset(shared[i].buckets, 0, sizeof(shared[i].buckets));
+        shared[i].free_entries = NULL;
+    }
+}
+
+// hashes a shared key, the low bits pick the shard and the rest the bucket
+unsigned int shared_hash(char *key)
+{
+    unsigned int hash = 2166136261u;
+    for (char *c = key; *c != '\0'; c++)
+    {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+    return hash;
+}
+
+// copies a shared value into value (MAX_BUFFER bytes) without taking any lock
+int shared_get(char *key, char *value)
+{
+    unsigned int hash = shared_hash(key), seq, steps;
+    shared_shard *shard = &shared[hash % SHARED_SHARDS];
+    shared_entry **bucket = &shard->buckets[(hash / SHARED_SHARDS) % SHARED_BUCKETS];
+    int found;
+
+    while (1)
+    {
+        // odd means a writer is part way through a change
+        seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            continue;
+        }
+
+        // entries are never freed, so a racing walk reads stale data but never faults
+        found = 0;
+        steps = 0;
+        for (shared_entry *entry = __atomic_load_n(bucket, __ATOMIC_ACQUIRE); entry != NULL; entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE))
+        {
+            if (strncmp(entry->key, key, MAX_BUFFER) == 0)
+            {
+                memcpy(value, entry->value, MAX_BUFFER);
+                found = 1;
+                break;
+            }
+
+            // a recycled entry can link into a loop, give up and retry if the shard changed
+            if (++steps % 64 == 0 && __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE) != seq)
+            {
+                break;
+            }
+        }
+
+        // the copy is only good if no writer ran while it was taken
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) == seq)
+        {
+            value[MAX_BUFFER - 1] = '\0';
+            return found ? 0 : -1;
+        }
+    }
+}
+
+// marks the start & end of a write to a shard, called with the shard lock held
+void shared_write_begin(shared_shard *shard)
+{
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void shared_write_end(shared_shard *shard)
+{
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+// adds or changes a shared key value pair
+int shared_put(char *key, char *value)
+{
+    unsigned int hash = shared_hash(key);
+    shared_shard *shard = &shared[hash % SHARED_SHARDS];
+    shared_entry **bucket = &shard->buckets[(hash / SHARED_SHARDS) % SHARED_BUCKETS];
+
+    // the key has to fit in a NOTIFY: SDELETE frame for SWATCH watchers
+    if (strlen(key) > MAX_KEY || strlen(value) >= MAX_BUFFER)
+    {
+        return -1;
+    }
+
+    // the store span starts once the shard is locked & ends before logging, both waits have lock spans
+    TRACE_LOCK(&shard->lock, "shard");
+    TRACE_START(store);
+
+    // change the value if the key exists
+    for (shared_entry *entry = *bucket; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->key, key) == 0)
+        {
+            shared_write_begin(shard);
+            strcpy(entry->value, value);
+            shared_write_end(shard);
+            TRACE_END("store", "SPUT", store);
+            repl_append('P', key, value);
+            pthread_mutex_unlock(&shard->lock);
+            return 0;
+        }
+    }
+
+    // otherwise reuse a deleted entry or allocate one
+    shared_entry *entry = shard->free_entries;
+    if (entry == NULL && (entry = malloc(sizeof(shared_entry))) == NULL)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    shared_write_begin(shard);
+    if (entry == shard->free_entries)
+    {
+        shard->free_entries = entry->next;
+    }
+    strcpy(entry->key, key);
+    strcpy(entry->value, value);
+    entry->next = *bucket;
+    __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+    shared_write_end(shard);
+    TRACE_END("store", "SPUT", store);
+    repl_append('P', key, value);
+
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+// removes a shared key value pair
+int shared_delete(char *key)
+{
+    unsigned int hash = shared_hash(key);
+    shared_shard *shard = &shared[hash % SHARED_SHARDS];
+
+    TRACE_LOCK(&shard->lock, "shard");
+    TRACE_START(store);
+    for (shared_entry **entry = &shard->buckets[(hash / SHARED_SHARDS) % SHARED_BUCKETS]; *entry != NULL; entry = &(*entry)->next)
+    {
+        if (strcmp((*entry)->key, key) == 0)
+        {
+            // unlink & keep the entry for reuse
+            shared_entry *removed = *entry;
+            shared_write_begin(shard);
+            __atomic_store_n(entry, removed->next, __ATOMIC_RELEASE);
+            removed->next = shard->free_entries;
+            shard->free_entries = removed;
+            shared_write_end(shard);
+            TRACE_END("store", "SDELETE", store);
+            repl_append('D', key, "");
+
+            pthread_mutex_unlock(&shard->lock);
+            return 0;
+        }
+    }
+    TRACE_END("store", "SDELETE", store);
+    pthread_mutex_unlock(&shard->lock);
+    return -1;
+}
+
+// nanoseconds elapsed since start
+long elapsed_ns(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000000000L + (end.tv_nsec - start->tv_nsec);
+}
+
+// encodes a value for storing, compressed if it is large enough & compression saves space
+// values are at most MAX_BUFFER bytes, so a small window & memLevel lose nothing
+int encode_value(client_data *encoded, char *value, long *compress_ns)
+{
+    int raw_len = strlen(value);
+    struct timespec start;
+
+    encoded->value = NULL;
+    encoded->raw_len = raw_len;
+    encoded->compressed = 0;
+    *compress_ns = -1;
+
+    if (compress_threshold > 0 && raw_len >= compress_threshold)
+    {
+        // deflate state is set up once per thread & reset for each value
+        if (value_stream == NULL)
+        {
+            z_stream *stream = calloc(1, sizeof(z_stream));
+            if (stream == NULL || deflateInit2(stream, Z_BEST_SPEED, Z_DEFLATED, 9, 1, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                free(stream);
+                return -1;
+            }
+            value_stream = stream;
+            pthread_setspecific(compress_key, stream);
+        }
+        uLong bound = deflateBound(value_stream, raw_len);
+        if ((encoded->value = malloc(bound)) == NULL)
+        {
+            return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        value_stream->next_in = (Bytef *) value;
+        value_stream->avail_in = raw_len;
+        value_stream->next_out = (Bytef *) encoded->value;
+        value_stream->avail_out = bound;
+        if (deflate(value_stream, Z_FINISH) == Z_STREAM_END && value_stream->total_out < raw_len + 1)
+        {
+            encoded->compressed = 1;
+            encoded->stored_len = value_stream->total_out;
+            encoded->value = realloc(encoded->value, encoded->stored_len); // shrinking, keeps the block on failure
+        }
+        deflateReset(value_stream);
+        *compress_ns = elapsed_ns(&start);
+
+        if (!encoded->compressed)
+        {
+            free(encoded->value);
+        }
+    }
+
+    // store raw
+    if (!encoded->compressed)
+    {
+        encoded->stored_len = raw_len + 1;
+        if ((encoded->value = malloc(encoded->stored_len)) == NULL)
+        {
+            return -1;
+        }
+        strcpy(encoded->value, value);
+    }
+    return 0;
+}
+
+// replaces the value in client data with an encoded one, called with mutex held as it updates the stats
+void store_value(client_data *data, client_data *encoded, long compress_ns)
+{
+    free_value(data);
+    data->value = encoded->value;
+    data->raw_len = encoded->raw_len;
+    data->stored_len = encoded->stored_len;
+    data->compressed = encoded->compressed;
+
+    if (compress_ns >= 0)
+    {
+        stat_compress_ns += compress_ns;
+        stat_compress_ops++;
+    }
+    stat_values++;
+    stat_compressed += data->compressed;
+    stat_raw_bytes += data->raw_len + 1;
+    stat_stored_bytes += data->stored_len;
+}
+
+// frees a thread's deflate state when the thread exits
+void compress_release(void *stream)
+{
+    deflateEnd((z_stream *) stream);
+    free(stream);
+}
+
+// returns a new copy of a value for GET, with wire_compress it is prefixed by RAW or ZLIB 'raw length'
+char *load_value(client_data *data, int wire_compress)
+{
+    char *value;
+    struct timespec start;
+
+    // send compressed data as is when base64 still beats the raw value
+    int encoded_len = 4 * ((data->stored_len + 2) / 3);
+    if (wire_compress && data->compressed && encoded_len + 16 < data->raw_len)
+    {
+        if ((value = malloc(encoded_len + 16)) == NULL)
+        {
+            return NULL;
+        }
+        int prefix = sprintf(value, "ZLIB %d ", data->raw_len);
+        EVP_EncodeBlock((unsigned char *) &value[prefix], (unsigned char *) data->value, data->stored_len);
+        return value;
+    }
+
+    int prefix = wire_compress ? strlen("RAW ") : 0;
+    if ((value = malloc(prefix + data->raw_len + 1)) == NULL)
+    {
+        return NULL;
+    }
+    strcpy(value, wire_compress ? "RAW " : "");
+
+    if (!data->compressed)
+    {
+        strcpy(&value[prefix], data->value);
+        return value;
+    }
+
+    // decompress
+    uLongf raw_len = data->raw_len;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (uncompress((Bytef *) &value[prefix], &raw_len, (Bytef *) data->value, data->stored_len) != Z_OK)
+    {
+        free(value);
+        return NULL;
+    }
+    stat_decompress_ns += elapsed_ns(&start);
+    stat_decompress_ops++;
+
+    value[prefix + raw_len] = '\0';
+    return value;
+}
+
+// frees a stored value
+void free_value(client_data *data)
+{
+    if (data->value == NULL)
+    {
+        return;
+    }
+    stat_values--;
+    stat_compressed -= data->compressed;
+    stat_raw_bytes -= data->raw_len + 1;
+    stat_stored_bytes -= data->stored_len;
+    free(data->value);
+    data->value = NULL;
+}
+
+// logs a shared namespace change for followers, called with the shard lock held
+void repl_append(char op, char *key, char *value)
+{
+    // followers joining take a snapshot, so changes before then needn't be logged
+    // a follower registered after this check copies the shard once this writer releases its lock
+    if (__atomic_load_n(&repl_followers, __ATOMIC_ACQUIRE) == NULL)
+    {
+        return;
+    }
+
+    TRACE_LOCK(&repl_mutex, "repl");
+    if (repl_followers != NULL)
+    {
+        repl_entry *entry = &repl_log[++repl_seq % REPL_LOG_SIZE];
+        entry->seq = repl_seq;
+        entry->op = op;
+        strcpy(entry->key, key);
+        strcpy(entry->value, value);
+        pthread_cond_broadcast(&repl_cond);
+    }
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+// appends a change to a replication frame, -1 if it doesn't fit
+int repl_frame_add(char *frame, int *len, char op, char *key, char *value)
+{
+    int needed = strlen(key) + strlen(value) + 4;
+    if (*len + needed >= REPL_BATCH)
+    {
+        return -1;
+    }
+    *len += sprintf(&frame[*len], op == 'P' ? "P %s\n%s\n" : "D %s\n", key, value);
+    return 0;
+}
+
+// ships the shared namespace to a follower, a snapshot first & then batches of logged changes
+// synced, if given, is set once the follower acknowledges having loaded a snapshot
+void replica_sender(client_conn *conn, int *synced)
+{
+    repl_follower follower = {0, synced != NULL, NULL};
+    char *frame = malloc(REPL_BATCH + MAX_BUFFER), *copy = NULL;
+    repl_entry *batch = malloc(REPL_COPY * sizeof(repl_entry));
+    unsigned long next = 0, head, snapshot_head = 0, shard_seq[SHARED_SHARDS] = {0};
+    int len, snapshot = 1, registered = 0, copy_len, copy_size = 0;
+    struct pollfd fds;
+
+    while (frame != NULL && batch != NULL)
+    {
+        // snapshot, changes logged after head are replayed once it is sent
+        if (snapshot)
+        {
+            pthread_mutex_lock(&repl_mutex);
+            if (!registered)
+            {
+                // any TLS client can ask to replicate, so only a few are served besides a new server
+                int followers = 0;
+                for (repl_follower *other = repl_followers; other != NULL; other = other->next)
+                {
+                    followers += !other->handover;
+                }
+                if (!follower.handover && followers == MAX_FOLLOWERS)
+                {
+                    pthread_mutex_unlock(&repl_mutex);
+                    conn_write(conn, "REPLICATE: ERROR", strlen("REPLICATE: ERROR"));
+                    break;
+                }
+                follower.next = repl_followers;
+                __atomic_store_n(&repl_followers, &follower, __ATOMIC_RELEASE);
+                registered = 1;
+            }
+            head = repl_seq;
+            follower.acked = head;
+            pthread_mutex_unlock(&repl_mutex);
+
+            len = sprintf(frame, "SNAPSHOT %lu", head);
+            int err = conn_write(conn, frame, len) <= 0;
+
+            // copy one shard at a time so writers only ever wait for their own shard
+            for (int i = 0; i < SHARED_SHARDS && !err; i++)
+            {
+                copy_len = 0;
+                pthread_mutex_lock(&shared[i].lock);
+                for (int j = 0; j < SHARED_BUCKETS && !err; j++)
+                {
+                    for (shared_entry *entry = shared[i].buckets[j]; entry != NULL; entry = entry->next)
+                    {
+                        int needed = strlen(entry->key) + strlen(entry->value) + 5;
+                        if (copy_len + needed > copy_size)
+                        {
+                            char *grown = realloc(copy, copy_size * 2 + needed);
+                            if (grown == NULL)
+                            {
+                                err = 1;
+                                break;
+                            }
+                            copy = grown;
+                            copy_size = copy_size * 2 + needed;
+                        }
+                        copy_len += sprintf(&copy[copy_len], "P %s\n%s\n", entry->key, entry->value);
+                    }
+                }
+
+                // changes to this shard up to here are in the copy, later ones aren't
+                pthread_mutex_lock(&repl_mutex);
+                shard_seq[i] = repl_seq;
+                pthread_mutex_unlock(&repl_mutex);
+                pthread_mutex_unlock(&shared[i].lock);
+
+                // send it in batches without holding any lock, each entry is a P key line & a value line
+                for (int pos = 0; pos < copy_len && !err; )
+                {
+                    len = sprintf(frame, "BATCH %lu %lu\n", head, head);
+                    while (pos < copy_len)
+                    {
+                        int entry_len = strchr(strchr(&copy[pos], '\n') + 1, '\n') + 1 - &copy[pos];
+                        if (len + entry_len >= REPL_BATCH)
+                        {
+                            break;
+                        }
+                        memcpy(&frame[len], &copy[pos], entry_len);
+                        len += entry_len;
+                        pos += entry_len;
+                    }
+                    frame[len] = '\0';
+                    err = conn_write(conn, frame, len) <= 0;
+                }
+            }
+
+            // marks the end of the snapshot, a new server starts accepting once it has it
+            len = sprintf(frame, "SYNCED %lu", head);
+            if (err || conn_write(conn, frame, len) <= 0)
+            {
+                break;
+            }
+            next = head + 1;
+            snapshot_head = head;
+            snapshot = 0;
+        }
+
+        // wait for changes, sending an empty batch each second as a heartbeat
+        pthread_mutex_lock(&repl_mutex);
+        if (repl_seq < next)
+        {
+            struct timespec timeout;
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_sec++;
+            pthread_cond_timedwait(&repl_cond, &repl_mutex, &timeout);
+        }
+
+        // the follower fell so far behind that the log was overwritten
+        head = repl_seq;
+        if (head >= next && head - next >= REPL_LOG_SIZE)
+        {
+            pthread_mutex_unlock(&repl_mutex);
+            snapshot = 1;
+            continue;
+        }
+
+        // copy out as many changes as always fit in one frame, writers wait on the lock meanwhile
+        int n_batch = 0;
+        for (; next <= head && n_batch < REPL_COPY; next++)
+        {
+            repl_entry *entry = &repl_log[next % REPL_LOG_SIZE];
+            batch[n_batch].op = entry->op;
+            strcpy(batch[n_batch].key, entry->key);
+            strcpy(batch[n_batch].value, entry->value);
+            n_batch++;
+        }
+        pthread_mutex_unlock(&repl_mutex);
+
+        // format the batch without the lock, leaving room to put the header in front
+        char *changes = &frame[64];
+        len = 0;
+        for (int i = 0; i < n_batch; i++)
+        {
+            // already in the snapshot's copy of its shard
+            if (next - n_batch + i <= shard_seq[shared_hash(batch[i].key) % SHARED_SHARDS])
+            {
+                continue;
+            }
+            repl_frame_add(changes, &len, batch[i].op, batch[i].key, batch[i].value);
+        }
+
+        // the header holds the last seq in the batch, known now
+        char header[64];
+        int header_len = sprintf(header, "BATCH %lu %lu\n", next - 1, head);
+        memcpy(changes - header_len, header, header_len);
+        if (conn_write(conn, changes - header_len, header_len + len) <= 0)
+        {
+            break;
+        }
+
+        // read acknowledgements without blocking
+        int err = 0;
+        fds.fd = conn->fd;
+        fds.events = POLLIN;
+        while (!err && ((conn->ssl != NULL && SSL_pending(conn->ssl) > 0) || poll(&fds, 1, 0) > 0))
+        {
+            char ack[MAX_BUFFER];
+            unsigned long acked;
+            memset(ack, 0, MAX_BUFFER);
+            if (conn_read(conn, ack, MAX_BUFFER - 1) <= 0)
+            {
+                err = 1;
+            }
+            else if (sscanf(ack, "ACK %lu", &acked) == 1)
+            {
+                pthread_mutex_lock(&repl_mutex);
+                follower.acked = acked;
+                if (synced != NULL && acked >= snapshot_head)
+                {
+                    *synced = 1;
+                }
+                pthread_mutex_unlock(&repl_mutex);
+            }
+        }
+        if (err)
+        {
+            break;
+        }
+    }
+
+    // stop tracking the follower
+    pthread_mutex_lock(&repl_mutex);
+    for (repl_follower **entry = &repl_followers; registered && *entry != NULL; entry = &(*entry)->next)
+    {
+        if (*entry == &follower)
+        {
+            __atomic_store_n(entry, follower.next, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&repl_mutex);
+    free(frame);
+    free(copy);
+    free(batch);
+}
+
+// compares two shared entries by key for qsort & bsearch
+int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((shared_entry *) a)->key, ((shared_entry *) b)->key);
+}
+
+// applies a complete snapshot, only changing & notifying keys that differ from what is stored
+int repl_sync(repl_stage *stage)
+{
+    char value[MAX_BUFFER];
+    char (*keys)[MAX_BUFFER] = NULL;
+    int n_keys, size = 0, err = 0;
+
+    qsort(stage->entries, stage->n_entries, sizeof(shared_entry), compare_entries);
+    for (int i = 0; i < stage->n_entries && !err; i++)
+    {
+        shared_entry *entry = &stage->entries[i];
+        if (shared_get(entry->key, value) < 0 || strcmp(value, entry->value) != 0)
+        {
+            if (shared_put(entry->key, entry->value) < 0)
+            {
+                err = 1;
+                break;
+            }
+            notify_watchers(SHARED_NAMESPACE, entry->key, "SPUT");
+        }
+    }
+
+    // delete keys the primary no longer has, listing one shard at a time
+    for (int i = 0; i < SHARED_SHARDS && !err; i++)
+    {
+        n_keys = 0;
+        pthread_mutex_lock(&shared[i].lock);
+        for (int j = 0; j < SHARED_BUCKETS && !err; j++)
+        {
+            for (shared_entry *entry = shared[i].buckets[j]; entry != NULL; entry = entry->next)
+            {
+                if (n_keys == size)
+                {
+                    char (*grown)[MAX_BUFFER] = realloc(keys, (size * 2 + 64) * MAX_BUFFER);
+                    if (grown == NULL)
+                    {
+                        err = 1;
+                        break;
+                    }
+                    keys = grown;
+                    size = size * 2 + 64;
+                }
+                strcpy(keys[n_keys++], entry->key);
+            }
+        }
+        pthread_mutex_unlock(&shared[i].lock);
+
+        for (int j = 0; j < n_keys && !err; j++)
+        {
+            shared_entry search;
+            strcpy(search.key, keys[j]);
+            if (bsearch(&search, stage->entries, stage->n_entries, sizeof(shared_entry), compare_entries) == NULL && shared_delete(keys[j]) == 0)
+            {
+                notify_watchers(SHARED_NAMESPACE, keys[j], "SDELETE");
+            }
+        }
+    }
+
+    free(keys);
+    free(stage->entries);
+    stage->entries = NULL;
+    stage->n_entries = stage->size = 0;
+    stage->loading = 0;
+    return err ? -1 : 0;
+}
+
+// applies one replication frame from the primary, snapshots are staged until SYNCED so reads never see them half loaded
+int repl_apply(char *frame, repl_stage *stage)
+{
+    unsigned long last, head;
+    char *line, *end;
+
+    if (strncmp(frame, "SNAPSHOT ", 9) == 0)
+    {
+        free(stage->entries);
+        stage->entries = NULL;
+        stage->n_entries = stage->size = 0;
+        stage->loading = 1;
+        return 0;
+    }
+    if (sscanf(frame, "SYNCED %lu", &last) == 1)
+    {
+        if (stage->loading && repl_sync(stage) < 0)
+        {
+            return -1;
+        }
+        head = last;
+        goto applied;
+    }
+    if (sscanf(frame, "BATCH %lu %lu", &last, &head) != 2 || (line = strchr(frame, '\n')) == NULL)
+    {
+        return -1;
+    }
+
+    // P key, value & D key lines
+    line++;
+    while (*line != '\0')
+    {
+        char op = line[0];
+        char *key = &line[2];
+        if ((end = strchr(key, '\n')) == NULL)
+        {
+            return -1;
+        }
+        *end = '\0';
+        line = end + 1;
+
+        if (op == 'P')
+        {
+            char *value = line;
+            if ((end = strchr(value, '\n')) == NULL)
+            {
+                return -1;
+            }
+            *end = '\0';
+            line = end + 1;
+
+            // a snapshot entry, kept until the whole snapshot has arrived
+            if (stage->loading)
+            {
+                if (strlen(key) > MAX_KEY || strlen(value) >= MAX_BUFFER)
+                {
+                    return -1;
+                }
+                if (stage->n_entries == stage->size)
+                {
+                    shared_entry *grown = realloc(stage->entries, (stage->size * 2 + 64) * sizeof(shared_entry));
+                    if (grown == NULL)
+                    {
+                        return -1;
+                    }
+                    stage->entries = grown;
+                    stage->size = stage->size * 2 + 64;
+                }
+                strcpy(stage->entries[stage->n_entries].key, key);
+                strcpy(stage->entries[stage->n_entries].value, value);
+                stage->n_entries++;
+                continue;
+            }
+
+            if (shared_put(key, value) < 0)
+            {
+                return -1;
+            }
+            notify_watchers(SHARED_NAMESPACE, key, "SPUT");
+        }
+        else
+        {
+            if (shared_delete(key) == 0)
+            {
+                notify_watchers(SHARED_NAMESPACE, key, "SDELETE");
+            }
+        }
+    }
+
+    // the snapshot is only applied at SYNCED
+    if (stage->loading)
+    {
+        return 0;
+    }
+
+applied:
+    pthread_mutex_lock(&repl_mutex);
+    applied_seq = last;
+    primary_seq = head;
+    clock_gettime(CLOCK_MONOTONIC, &last_batch);
+    pthread_mutex_unlock(&repl_mutex);
+    return 0;
+}
+
+// follows the primary, reconnecting & taking a fresh snapshot whenever the stream breaks
+void *replica_follower(void *address)
+{
+    char *frame = malloc(REPL_BATCH + MAX_BUFFER), ack[64];
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL *ssl;
+    repl_stage stage = {0, NULL, 0, 0}; // reset by the SNAPSHOT starting each connection
+    int len;
+
+    if (frame == NULL || ctx == NULL)
+    {
+        fprintf(stderr, "Error initialising follower\n");
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+    while (1)
+    {
+        // Connect to the primary over TLS
+        BIO *bio = BIO_new_ssl_connect(ctx);
+        if (bio == NULL || BIO_get_ssl(bio, &ssl) <= 0)
+        {
+            fprintf(stderr, "Error initialising follower BIO\n");
+            BIO_free_all(bio);
+            sleep(1);
+            continue;
+        }
+        SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
+        if (BIO_set_conn_hostname(bio, (char *) address) <= 0 || BIO_do_connect(bio) <= 0 || BIO_do_handshake(bio) <= 0
+            || BIO_write(bio, "REPLICATE", strlen("REPLICATE")) <= 0)
+        {
+            fprintf(stderr, "Error connecting to primary\n");
+            BIO_free_all(bio);
+            sleep(1);
+            continue;
+        }
+
+        // apply frames, acknowledging each batch
+        while ((len = BIO_read(bio, frame, REPL_BATCH + MAX_BUFFER - 1)) > 0)
+        {
+            frame[len] = '\0';
+            if (strcmp(frame, "REPLICATE: ERROR") == 0)
+            {
+                fprintf(stderr, "Error primary has too many followers\n");
+                break;
+            }
+            if (repl_apply(frame, &stage) < 0)
+            {
+                fprintf(stderr, "Error applying replication frame\n");
+                break;
+            }
+            if (strncmp(frame, "BATCH ", 6) == 0)
+            {
+                len = sprintf(ack, "ACK %lu", applied_seq);
+                if (BIO_write(bio, ack, len) <= 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        fprintf(stderr, "Error lost connection to primary\n");
+        BIO_free_all(bio);
+        sleep(1);
+    }
+    return NULL;
+}
+
+// takes over from the server running with a handover socket at path, -1 if there is none so this one starts afresh
+int handover_receive(char *path, SSL_CTX *ctx, int *listen_fd, int *unix_fd)
+{
+    struct sockaddr_un addr;
+    handover_msg msg;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {&msg, sizeof(msg)};
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    int fds[2] = {-1, -1};
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // nothing listening, or a socket left by a server that has gone
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // ask for the listeners, they arrive as SCM_RIGHTS with the TLS ticket keys
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    if (!peer_authorised(fd) || send(fd, "HANDOVER", strlen("HANDOVER"), MSG_NOSIGNAL) <= 0
+        || recvmsg(fd, &hdr, 0) != sizeof(msg) || (cmsg = CMSG_FIRSTHDR(&hdr)) == NULL
+        || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN((msg.has_unix ? 2 : 1) * sizeof(int)))
+    {
+        fprintf(stderr, "Error receiving listening sockets\n");
+        close(fd);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), (msg.has_unix ? 2 : 1) * sizeof(int));
+    *listen_fd = fds[0];
+    *unix_fd = fds[1];
+    SSL_CTX_set_tlsext_ticket_keys(ctx, msg.ticket_keys, TICKET_KEYS_LEN);
+
+    // load the shared namespace before accepting, the old server keeps sending its changes until it exits
+    char *frame = malloc(REPL_BATCH + MAX_BUFFER);
+    repl_stage stage = {0, NULL, 0, 0};
+    int len;
+    while (frame != NULL && (len = read(fd, frame, REPL_BATCH + MAX_BUFFER - 1)) > 0)
+    {
+        frame[len] = '\0';
+        int synced = strncmp(frame, "SYNCED ", 7) == 0;
+        if (repl_apply(frame, &stage) < 0)
+        {
+            break;
+        }
+        if (synced)
+        {
+            // the old server waits for this before it may exit
+            len = sprintf(frame, "ACK %lu", applied_seq);
+            if (send(fd, frame, len, MSG_NOSIGNAL) <= 0)
+            {
+                fprintf(stderr, "Error acknowledging shared namespace\n");
+            }
+            free(frame);
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, handover_follow, (void *) (intptr_t) fd) != 0)
+            {
+                fprintf(stderr, "Error producing thread\n");
+                close(fd);
+            } else {
+                pthread_detach(thread);
+            }
+            return 0;
+        }
+    }
+
+    // the listeners are ours now whatever happened to the snapshot
+    fprintf(stderr, "Error receiving shared namespace\n");
+    free(stage.entries);
+    free(frame);
+    close(fd);
+    return 0;
+}
+
+// applies changes made by sessions draining on the old server, until it exits
+void *handover_follow(void *handover_fd)
+{
+    int fd = (int) (intptr_t) handover_fd, len;
+    char *frame = malloc(REPL_BATCH + MAX_BUFFER), ack[64];
+    repl_stage stage = {0, NULL, 0, 0}; // only used if the old server has to send a new snapshot
+
+    while (frame != NULL && (len = read(fd, frame, REPL_BATCH + MAX_BUFFER - 1)) > 0)
+    {
+        frame[len] = '\0';
+        if (repl_apply(frame, &stage) < 0)
+        {
+            fprintf(stderr, "Error applying replication frame\n");
+            break;
+        }
+        if (strncmp(frame, "BATCH ", 6) == 0)
+        {
+            len = sprintf(ack, "ACK %lu", applied_seq);
+            if (send(fd, ack, len, MSG_NOSIGNAL) <= 0)
+            {
+                break;
+            }
+        }
+    }
+    free(stage.entries);
+    free(frame);
+    close(fd);
+    return NULL;
+}
+
+// hands the listeners to the first new server to ask, then streams it the shared namespace
+void *handover_listener(void *listen_fd)
+{
+    int fd = (int) (intptr_t) listen_fd, new_fd;
+    char buffer[MAX_BUFFER];
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {&handover, sizeof(handover)};
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    int n_fds = handover.has_unix ? 2 : 1;
+
+    while (1)
+    {
+        new_fd = accept(fd, NULL, NULL);
+        if (new_fd < 0)
+        {
+            fprintf(stderr, "Error accepting handover connection\n");
+            continue;
+        }
+
+        // only the same user may take over, as it gets every client from now on
+        memset(buffer, 0, MAX_BUFFER);
+        if (!peer_authorised(new_fd) || read(new_fd, buffer, MAX_BUFFER - 1) <= 0 || strcmp(buffer, "HANDOVER") != 0)
+        {
+            fprintf(stderr, "Error handover peer not authorised\n");
+            close(new_fd);
+            continue;
+        }
+
+        // pass the listeners with SCM_RIGHTS
+        memset(&hdr, 0, sizeof(hdr));
+        memset(control, 0, sizeof(control));
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), listeners, n_fds * sizeof(int));
+        if (sendmsg(new_fd, &hdr, MSG_NOSIGNAL) < 0)
+        {
+            fprintf(stderr, "Error sending listening sockets\n");
+            close(new_fd);
+            continue;
+        }
+        break;
+    }
+
+    // the new server has bound the path again, so no other can reach this one
+    close(fd);
+
+    // stop accepting, connections now queue for the new server
+    if (write(stop_pipe[1], "x", 1) < 0)
+    {
+        fprintf(stderr, "Error stopping listeners\n");
+    }
+
+    // stream the shared namespace & changes from draining sessions until this server exits
+    client_conn *conn = conn_new(NULL, new_fd);
+    if (conn == NULL)
+    {
+        fprintf(stderr, "Error initialising connection\n");
+        close(new_fd);
+        return NULL;
+    }
+    replica_sender(conn, &handover_synced);
+    conn_free(conn);
+    return NULL;
+}
+
+// waits for sessions to disconnect & the new server to have every change, up to HANDOVER_DRAIN seconds
+void handover_drain(void)
+{
+    struct timespec start;
+    int busy = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (busy && elapsed_ns(&start) < HANDOVER_DRAIN * 1000000000L)
+    {
+        pthread_mutex_lock(&mutex);
+        busy = n_sessions > 0;
+        pthread_mutex_unlock(&mutex);
+
+        // the new server must have the whole snapshot, it is not a follower until the stream starts
+        pthread_mutex_lock(&repl_mutex);
+        if (!handover_synced)
+        {
+            busy = 1;
+        }
+        // other followers reconnect to the new server, so a stalled one can't hold this one up
+        for (repl_follower *follower = repl_followers; follower != NULL; follower = follower->next)
+        {
+            if (follower->handover && follower->acked < repl_seq)
+            {
+                busy = 1;
+            }
+        }
+        pthread_mutex_unlock(&repl_mutex);
+
+        if (busy)
+        {
+            usleep(100000);
+        }
+    }
+
+    if (busy)
+    {
+        fprintf(stderr, "Error sessions still connected after handover\n");
+    }
+}
+
+// opens the trace file & starts the thread draining spans into it, truncating it unless append is set
+// every write is one whole event with O_APPEND, so two servers sharing the file never overwrite each other
+int trace_open(char *path, int append)
+{
+    struct stat st;
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (append ? 0 : O_TRUNC), S_IRUSR | S_IWUSR)) < 0
+        || fstat(trace_fd, &st) < 0 || pthread_key_create(&trace_key, trace_release) != 0)
+    {
+        return -1;
+    }
+
+    // JSON array format, the closing bracket is optional so the file is readable even if the server dies
+    if (st.st_size == 0 && write(trace_fd, "[\n", 2) != 2)
+    {
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, trace_drainer, NULL) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// decides if the next request on this thread is traced, a per thread xorshift so sampling shares nothing
+int trace_next(void)
+{
+    if (trace_state == 0)
+    {
+        trace_state = (unsigned int) (uintptr_t) &trace_state ^ (unsigned int) time(NULL) ^ 0x9e3779b9;
+    }
+    trace_state ^= trace_state << 13;
+    trace_state ^= trace_state >> 17;
+    trace_state ^= trace_state << 5;
+    return trace_state % trace_rate == 0;
+}
+
+// claims a ring for this thread, reusing one released by a thread that exited
+trace_ring *trace_claim(void)
+{
+    trace_ring *ring;
+    for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        if (__atomic_load_n(&ring->in_use, __ATOMIC_RELAXED) == 0 && __atomic_exchange_n(&ring->in_use, 1, __ATOMIC_ACQUIRE) == 0)
+        {
+            return ring;
+        }
+    }
+
+    if ((ring = calloc(1, sizeof(trace_ring))) == NULL)
+    {
+        return NULL;
+    }
+    ring->in_use = 1;
+    ring->id = __atomic_add_fetch(&trace_ids, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+    return ring;
+}
+
+// gives a ring back when its thread exits, spans left in it are still drained
+void trace_release(void *ring)
+{
+    __atomic_store_n(&((trace_ring *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// records a span from start until now, dropping it rather than waiting if the ring is full
+void trace_span(const char *name, const char *detail, struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    trace_ring *ring = trace_local;
+    if (ring == NULL)
+    {
+        if ((ring = trace_claim()) == NULL)
+        {
+            return;
+        }
+        trace_local = ring;
+        pthread_setspecific(trace_key, ring);
+    }
+
+    unsigned long head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // only letters & digits, the detail may come from a client & is written into JSON
+    trace_event *event = &ring->events[head % TRACE_RING];
+    int len = 0;
+    for (; detail[len] != '\0' && len < sizeof(event->detail) - 1 && isalnum((unsigned char) detail[len]); len++)
+    {
+        event->detail[len] = detail[len];
+    }
+    event->detail[len] = '\0';
+    event->name = name;
+    event->start_ns = start->tv_sec * 1000000000L + start->tv_nsec;
+    event->duration_ns = (end.tv_sec - start->tv_sec) * 1000000000L + (end.tv_nsec - start->tv_nsec);
+
+    // publish the span to the drain thread
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// writes every recorded span to the trace file
+void trace_drain(void)
+{
+    char line[MAX_BUFFER * 2];
+    int len;
+
+    if (trace_fd < 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&trace_mutex);
+    for (trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
+        for (; tail < head; tail++)
+        {
+            trace_event *event = &ring->events[tail % TRACE_RING];
+            len = snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"%s\"}},\n",
+                event->name, event->start_ns / 1000.0, event->duration_ns / 1000.0, getpid(), ring->id, event->detail);
+            trace_write(line, len);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        // report spans lost to a full ring as a counter
+        unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            len = snprintf(line, sizeof(line), "{\"name\":\"dropped\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"spans\":%lu}},\n",
+                (now.tv_sec * 1000000000L + now.tv_nsec) / 1000.0, getpid(), ring->id, dropped);
+            trace_write(line, len);
+        }
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+// appends one event to the trace file in a single write, so it is never split by another server's events
+void trace_write(char *line, int len)
+{
+    if (len >= MAX_BUFFER * 2 || write(trace_fd, line, len) != len)
+    {
+        fprintf(stderr, "Error writing trace file\n");
+    }
+}
+
+// drains the rings ten times a second, off the request path
+void *trace_drainer(void *arg)
+{
+    while (1)
+    {
+        usleep(100000);
+        trace_drain();
+    }
+    return NULL;
+}
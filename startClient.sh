@@ -3,6 +3,6 @@
 host=$1
 port=$2
 
-gcc -o client client.c -lssl -lcrypto
+gcc -o client client.c client_lib.c -lssl -lcrypto -lz -lpthread
 
 ./client $host $port
\ No newline at end of file
@@ -1,7 +1,5 @@
 #!/bin/zsh
 
-port=$1
+gcc -o server server.c -lssl -lcrypto -lz
 
-gcc -o server server.c -lssl -lcrypto
-
-./server $port
\ No newline at end of file
+./server "$@"
\ No newline at end of file